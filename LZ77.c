@@ -1,6 +1,8 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include "huffman.h"
+#include "deflate.h"
 #include "inflate.h"
 
 /**
@@ -0,0 +1,462 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "huffman.h"
+#include "deflate.h"
+#include "inflate.h"
+#include "filter.h"
+#include "png.h"
+#include "apng.h"
+#include "checksum.h"
+#include "pool.h"
+#include "convert.h"
+
+//The frames of one batch being inflated and unfiltered across threads
+struct FrameJobs {
+    struct APNGFile* apng;
+    int first;  //index of the batch's first frame
+};
+
+/**
+ * Reads a big endian 4 byte number
+ * @param uint8_t* data is the first byte
+ * @return the number
+*/
+uint32_t read_u32(uint8_t* data) {
+    return (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 | (uint32_t) data[2] << 8 | data[3];
+}
+
+/**
+ * Parses the data of an fcTL chunk, not counting its sequence number, and checks the frame fits on the canvas
+ * @param uint8_t* data is the fcTL chunk data after the sequence number
+ * @param unsigned int len is the length of the fcTL chunk data after the sequence number
+ * @param struct IHDR* ihdr is the image header giving the canvas size
+ * @param struct FrameControl* fc is set to the frame control
+ * @return -1 if error occurs 0 otherwise
+*/
+int parse_fcTL(uint8_t* data, unsigned int len, struct IHDR* ihdr, struct FrameControl* fc) {
+    if (len != 22) {
+        fprintf(stderr, "INVALID fcTL LENGTH\n");
+        return -1;
+    }
+    fc->width = read_u32(data);
+    fc->height = read_u32(data + 4);
+    fc->x_offset = read_u32(data + 8);
+    fc->y_offset = read_u32(data + 12);
+    fc->delay_num = (data[16] << 8) | data[17];
+    fc->delay_den = (data[18] << 8) | data[19];
+    fc->dispose_op = data[20];
+    fc->blend_op = data[21];
+
+    if (!fc->width || !fc->height || fc->x_offset > ihdr->width || fc->width > ihdr->width - fc->x_offset ||
+        fc->y_offset > ihdr->height || fc->height > ihdr->height - fc->y_offset) {
+        fprintf(stderr, "APNG FRAME IS OUTSIDE THE IMAGE\n");
+        return -1;
+    }
+    if (fc->dispose_op > APNG_DISPOSE_PREVIOUS || fc->blend_op > APNG_BLEND_OVER) {
+        fprintf(stderr, "INVALID APNG DISPOSE OR BLEND OPERATION\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Adds compressed data to the end of a frame's data
+ * @param struct APNGFrame* frame is the frame
+ * @param uint8_t* data is the compressed data
+ * @param size_t len is the length of the compressed data
+*/
+void append_frame_data(struct APNGFrame* frame, uint8_t* data, size_t len) {
+    if (frame->len + len > frame->cap) {
+        frame->cap = (frame->len + len) * 2;
+        frame->data = realloc(frame->data, frame->cap);
+    }
+    memcpy(frame->data + frame->len, data, len);
+    frame->len += len;
+}
+
+/**
+ * Checks the sequence number at the start of an fcTL or fdAT chunk.  They count up from 0 across both chunk types
+ * @param uint8_t* data is the chunk data
+ * @param unsigned int len is the length of the chunk data
+ * @param unsigned int* expected is the next sequence number, counted up when it matches
+ * @return -1 if error occurs 0 otherwise
+*/
+int check_sequence(uint8_t* data, unsigned int len, unsigned int* expected) {
+    if (len < 4 || read_u32(data) != *expected) {
+        fprintf(stderr, "APNG SEQUENCE NUMBER OUT OF ORDER\n");
+        return -1;
+    }
+    (*expected)++;
+    return 0;
+}
+
+/**
+ * Reads every chunk of a PNG or APNG file, gathering the compressed data of each frame.  Unlike read_all_chunks each
+ * chunk type is handled as the APNG spec says: acTL must come before IDAT, fcTL and fdAT sequence numbers must count
+ * up, and an IDAT with no fcTL before it is a default image outside the animation which is skipped.  A file with no
+ * acTL is read as one frame
+ * As defined here: https://www.w3.org/TR/png/#apng-frame-based-animation
+ * @param char* filepath is the file's path
+ * @param struct APNGFile* apng is set to what was read.  Free with free_APNG_file even if an error occurs
+ * @return -1 if error occurs 0 otherwise
+*/
+int read_APNG_chunks(char* filepath, struct APNGFile* apng) {
+    memset(apng, 0, sizeof(struct APNGFile));
+    FILE* fp = fopen(filepath, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "COULD NOT OPEN %s\n", filepath);
+        return -1;
+    }
+    if (!check_signature(fp)) {
+        fprintf(stderr, "INVALID SIG\n");
+        fclose(fp);
+        return -1;
+    }
+
+    uint8_t* data = NULL;
+    unsigned int cap = 0;
+    unsigned int sequence = 0;
+    size_t frames_cap = 0;      //frames grows as fcTLs arrive since acTL's frame count is not to be trusted
+    int seen_IHDR = 0;
+    int idat_state = 0;         //0 before the IDATs, 1 in them, 2 after them
+    int skip_default = 0;       //the IDATs are a default image outside the animation
+    int result = -1;
+    while (1) {
+        unsigned int len;
+        char chunk_type[4];
+        if (read_chunk_header(fp, &len, chunk_type)) break;
+        if (len > cap) {
+            cap = len;
+            data = realloc(data, cap);
+        }
+        if (fread(data, 1, len, fp) != len) {
+            fprintf(stderr, "INVALID READ ON CHUNK %.4s DATA\n", chunk_type);
+            break;
+        }
+        uint32_t crc = crc32_update(crc32_update(0, (uint8_t*) chunk_type, 4), data, len);
+        if (check_chunk_crc(fp, crc, chunk_type)) break;
+
+        if (!seen_IHDR && memcmp(chunk_type, "IHDR", 4)) {
+            fprintf(stderr, "IHDR IS NOT THE FIRST CHUNK\n");
+            break;
+        }
+        if (idat_state == 1 && memcmp(chunk_type, "IDAT", 4)) idat_state = 2;
+
+        if (!memcmp(chunk_type, "IHDR", 4)) {
+            if (seen_IHDR || parse_IHDR(data, len, &apng->ihdr)) break;
+            seen_IHDR = 1;
+        } else if (!memcmp(chunk_type, "PLTE", 4)) {
+            if (len > sizeof(apng->palette)) {
+                fprintf(stderr, "INVALID PLTE LENGTH\n");
+                break;
+            }
+            memcpy(apng->palette, data, len);
+            apng->palette_len = len;
+        } else if (!memcmp(chunk_type, "tRNS", 4)) {
+            if (len <= sizeof(apng->trns)) {
+                memcpy(apng->trns, data, len);
+                apng->trns_len = len;
+            }
+        } else if (!memcmp(chunk_type, "acTL", 4)) {
+            if (len != 8 || idat_state || apng->num_frames) {
+                fprintf(stderr, "INVALID acTL\n");
+                break;
+            }
+            apng->num_frames = read_u32(data);
+            apng->num_plays = read_u32(data + 4);
+            if (!apng->num_frames || apng->num_frames > 0x7fffffff) {
+                fprintf(stderr, "INVALID acTL\n");
+                break;
+            }
+        } else if (!memcmp(chunk_type, "fcTL", 4) && apng->num_frames) {
+            if (check_sequence(data, len, &sequence)) break;
+            if ((unsigned int) apng->frame_count == apng->num_frames) {
+                fprintf(stderr, "MORE APNG FRAMES THAN acTL SAYS\n");
+                break;
+            }
+            if ((size_t) apng->frame_count == frames_cap) {
+                frames_cap = frames_cap ? frames_cap * 2 : APNG_BATCH_FRAMES;
+                struct APNGFrame* frames = realloc(apng->frames, frames_cap * sizeof(struct APNGFrame));
+                if (frames == NULL) {
+                    fprintf(stderr, "TOO MANY APNG FRAMES\n");
+                    break;
+                }
+                apng->frames = frames;
+            }
+            struct APNGFrame* frame = &apng->frames[apng->frame_count];
+            memset(frame, 0, sizeof(struct APNGFrame));
+            if (parse_fcTL(data + 4, len - 4, &apng->ihdr, &frame->fc)) break;
+            frame->fc.sequence = sequence - 1;
+            //the first frame has nothing before it to go back to
+            if (apng->frame_count == 0 && frame->fc.dispose_op == APNG_DISPOSE_PREVIOUS) {
+                frame->fc.dispose_op = APNG_DISPOSE_BACKGROUND;
+            }
+            if (idat_state == 0 && (frame->fc.x_offset || frame->fc.y_offset ||
+                                    frame->fc.width != apng->ihdr.width || frame->fc.height != apng->ihdr.height)) {
+                fprintf(stderr, "FIRST APNG FRAME MUST COVER THE WHOLE IMAGE\n");
+                break;
+            }
+            apng->frame_count++;
+        } else if (!memcmp(chunk_type, "IDAT", 4)) {
+            if (idat_state == 2) {
+                fprintf(stderr, "IDAT CHUNKS ARE NOT CONSECUTIVE\n");
+                break;
+            }
+            if (idat_state == 0) {
+                if (!apng->num_frames) { //a plain PNG is one frame covering the whole image
+                    apng->num_frames = 1;
+                    apng->frames = calloc(1, sizeof(struct APNGFrame));
+                    apng->frames[0].fc.width = apng->ihdr.width;
+                    apng->frames[0].fc.height = apng->ihdr.height;
+                    apng->frame_count = 1;
+                }
+                skip_default = apng->frame_count == 0;
+                idat_state = 1;
+            }
+            if (!skip_default) append_frame_data(&apng->frames[0], data, len);
+        } else if (!memcmp(chunk_type, "fdAT", 4) && apng->num_frames) {
+            if (check_sequence(data, len, &sequence)) break;
+            if (idat_state == 0 || apng->frame_count == 0 || (apng->frame_count == 1 && !skip_default)) {
+                fprintf(stderr, "fdAT WITH NO FRAME TO BELONG TO\n");
+                break;
+            }
+            append_frame_data(&apng->frames[apng->frame_count - 1], data + 4, len - 4);
+        } else if (!memcmp(chunk_type, "IEND", 4)) {
+            result = 0;
+            break;
+        }
+    }
+    free(data);
+    fclose(fp);
+    if (result) return -1;
+
+    if (idat_state == 0) {
+        fprintf(stderr, "NO IDAT CHUNK\n");
+        return -1;
+    }
+    if ((unsigned int) apng->frame_count != apng->num_frames) {
+        fprintf(stderr, "APNG HAS %d FRAMES BUT acTL SAYS %u\n", apng->frame_count, apng->num_frames);
+        return -1;
+    }
+    for (int i = 0; i < apng->frame_count; i++) {
+        if (apng->frames[i].len == 0) {
+            fprintf(stderr, "APNG FRAME %d HAS NO IMAGE DATA\n", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Frees everything read_APNG_chunks allocated
+ * @param struct APNGFile* apng is the file
+*/
+void free_APNG_file(struct APNGFile* apng) {
+    for (int i = 0; i < apng->frame_count; i++) {
+        free(apng->frames[i].data);
+        free(apng->frames[i].pixels);
+    }
+    free(apng->frames);
+    apng->frames = NULL;
+    apng->frame_count = 0;
+}
+
+/**
+ * Refill for an InflateStream that hands over a whole block of memory the first time it is called
+ * @param void* ctx is the struct MemorySource*
+ * @param uint8_t** buf is set to the compressed bytes
+ * @param size_t* len is set to the number of compressed bytes
+ * @return 0 once the memory has been handed over 1 otherwise
+*/
+int refill_memory(void* ctx, uint8_t** buf, size_t* len) {
+    struct MemorySource* source = ctx;
+    if (source->given) return 0;
+    source->given = 1;
+    *buf = source->data;
+    *len = source->len;
+    return 1;
+}
+
+/**
+ * Inflates and unfilters one frame of a batch.  Every frame is its own zlib stream so frames can be decoded in any
+ * order, only compositing has to go in order
+ * @param void* ctx is the struct FrameJobs*
+ * @param int index is the frame within the batch
+*/
+void decode_frame_job(void* ctx, int index) {
+    struct FrameJobs* jobs = ctx;
+    struct APNGFrame* frame = &jobs->apng->frames[jobs->first + index];
+
+    struct IHDR ihdr = jobs->apng->ihdr;
+    ihdr.width = frame->fc.width;
+    ihdr.height = frame->fc.height;
+    struct MemorySource source = {frame->data, frame->len, 0};
+    struct InflateStream* inflate = malloc(sizeof(struct InflateStream));
+    inflate_init(inflate, refill_memory, &source);
+    frame->pixels = inflate_image(inflate, &ihdr, 0, NULL, NULL);
+    memset(&frame->stats, 0, sizeof(struct InflateStats));
+    add_inflate_stats(inflate, &frame->stats);
+    inflate_end(inflate);
+    free(inflate);
+}
+
+/**
+ * Draws one row of a frame over the canvas
+ * As defined here: https://www.w3.org/TR/png/#fcTL-chunk
+ * @param uint8_t* dest is the canvas row at the frame's x offset, RGBA
+ * @param uint8_t* src is the frame row, RGBA
+ * @param int width is the frame width
+ * @param uint8_t blend_op is APNG_BLEND_SOURCE to replace the canvas or APNG_BLEND_OVER to alpha blend over it
+*/
+void blend_row(uint8_t* dest, uint8_t* src, int width, uint8_t blend_op) {
+    if (blend_op == APNG_BLEND_SOURCE) {
+        memcpy(dest, src, (size_t) width * 4);
+        return;
+    }
+    for (int x = 0; x < width; x++, dest += 4, src += 4) {
+        int src_alpha = src[3];
+        if (src_alpha == 255 || dest[3] == 0) {
+            memcpy(dest, src, 4);
+        } else if (src_alpha) {
+            //src over dest with both alphas scaled by 255 to keep the precision
+            int src_weight = src_alpha * 255;
+            int dest_weight = (255 - src_alpha) * dest[3];
+            int total = src_weight + dest_weight;
+            for (int c = 0; c < 3; c++) dest[c] = (src[c] * src_weight + dest[c] * dest_weight) / total;
+            dest[3] = total / 255;
+        }
+    }
+}
+
+/**
+ * Decodes an APNG, handing the canvas to frame_callback after each frame is drawn.  Frames are inflated and
+ * unfiltered a batch at a time across threads, then drawn and disposed of in order on the calling thread.
+ * A plain PNG is one frame
+ * @param char* filepath is the file's path
+ * @param struct IHDR* ihdr is set to the image header
+ * @param int first_frame_only is true to only decode the default image, the one viewers without APNG support show.
+ * This reads the file only up to the end of the IDAT chunks and never looks at the fdAT chunks
+ * @param int threads is the most threads to decode frames on
+ * @param int (*frame_callback)(void* user, int index, uint8_t* canvas, struct FrameControl* fc) is given the
+ * canvas as width * height RGBA pixels after each frame is drawn.  Return nonzero to stop decoding
+ * @param void* user is passed to frame_callback
+ * @param struct InflateStats* stats is set to the counters of every frame's decode added up.  May be NULL
+ * @return the number of frames handed to frame_callback or -1 if error occurs
+*/
+int read_APNG(char* filepath, struct IHDR* ihdr, int first_frame_only, int threads,
+              int (*frame_callback)(void* user, int index, uint8_t* canvas, struct FrameControl* fc), void* user,
+              struct InflateStats* stats) {
+    if (stats) memset(stats, 0, sizeof(struct InflateStats));
+    struct APNGFile* apng = malloc(sizeof(struct APNGFile));
+    struct PNGStream* stream = NULL;
+    struct ColorInfo* color = malloc(sizeof(struct ColorInfo));
+
+    if (first_frame_only) {
+        stream = malloc(sizeof(struct PNGStream));
+        memset(apng, 0, sizeof(struct APNGFile));
+        if (open_png_stream(filepath, stream)) {
+            close_png_stream(stream);
+            free(stream);
+            free(apng);
+            free(color);
+            return -1;
+        }
+        //the stream already has everything up to the IDATs, so the default image is a frame of its own
+        apng->ihdr = stream->ihdr;
+        memcpy(apng->palette, stream->palette, sizeof(apng->palette));
+        apng->palette_len = stream->palette_len;
+        memcpy(apng->trns, stream->trns, sizeof(apng->trns));
+        apng->trns_len = stream->trns_len;
+        apng->num_frames = 1;
+        apng->frame_count = 1;
+        apng->frames = calloc(1, sizeof(struct APNGFrame));
+        apng->frames[0].fc.width = apng->ihdr.width;
+        apng->frames[0].fc.height = apng->ihdr.height;
+
+        struct InflateStream* inflate = malloc(sizeof(struct InflateStream));
+        inflate_init(inflate, refill_IDAT, stream);
+        apng->frames[0].pixels = inflate_image(inflate, &apng->ihdr, 0, NULL, NULL);
+        add_inflate_stats(inflate, stats);
+        inflate_end(inflate);
+        free(inflate);
+        close_png_stream(stream);
+        free(stream);
+    } else if (read_APNG_chunks(filepath, apng)) {
+        free_APNG_file(apng);
+        free(apng);
+        free(color);
+        return -1;
+    }
+    *ihdr = apng->ihdr;
+
+    init_color_info(color, ihdr->color_type, ihdr->bit_depth, apng->palette, apng->palette_len, apng->trns, apng->trns_len);
+    int bits = bits_per_pixel(ihdr->color_type, ihdr->bit_depth);
+    size_t canvas_row = (size_t) ihdr->width * 4;
+    uint8_t* canvas = calloc((size_t) ihdr->height * canvas_row, 1); //starts fully transparent black
+    uint8_t* saved = NULL; //region under a frame disposed of with APNG_DISPOSE_PREVIOUS
+    uint8_t* rgba = malloc(canvas_row);
+
+    int shown = 0;
+    int stopped = 0;
+    int batch_size = (threads > 1 ? threads : 1) * APNG_BATCH_FRAMES;
+    for (int first = 0; first < apng->frame_count && !stopped && shown >= 0; first += batch_size) {
+        int count = apng->frame_count - first < batch_size ? apng->frame_count - first : batch_size;
+        if (!first_frame_only) {
+            struct FrameJobs jobs = {apng, first};
+            run_jobs(threads, count, decode_frame_job, &jobs);
+            for (int i = first; i < first + count && stats; i++) {
+                stats->tree_cache_hits += apng->frames[i].stats.tree_cache_hits;
+                stats->tree_cache_misses += apng->frames[i].stats.tree_cache_misses;
+            }
+        }
+
+        for (int i = first; i < first + count && !stopped; i++) {
+            struct APNGFrame* frame = &apng->frames[i];
+            struct FrameControl* fc = &frame->fc;
+            if (frame->pixels == NULL) {
+                fprintf(stderr, "COULD NOT DECODE APNG FRAME %d\n", i);
+                shown = -1;
+                break;
+            }
+            uint8_t* region = canvas + fc->y_offset * canvas_row + (size_t) fc->x_offset * 4;
+            size_t region_row = (size_t) fc->width * 4;
+
+            if (fc->dispose_op == APNG_DISPOSE_PREVIOUS) {
+                saved = realloc(saved, fc->height * region_row);
+                for (unsigned int y = 0; y < fc->height; y++) {
+                    memcpy(saved + y * region_row, region + y * canvas_row, region_row);
+                }
+            }
+
+            size_t row_len = scanline_bytes(fc->width, bits);
+            for (unsigned int y = 0; y < fc->height; y++) {
+                color->convert(color, frame->pixels + y * row_len, fc->width, rgba);
+                blend_row(region + y * canvas_row, rgba, fc->width, fc->blend_op);
+            }
+            free(frame->pixels);
+            frame->pixels = NULL;
+
+            shown++;
+            if (frame_callback(user, i, canvas, fc)) stopped = 1;
+
+            if (fc->dispose_op == APNG_DISPOSE_BACKGROUND) {
+                for (unsigned int y = 0; y < fc->height; y++) memset(region + y * canvas_row, 0, region_row);
+            } else if (fc->dispose_op == APNG_DISPOSE_PREVIOUS) {
+                for (unsigned int y = 0; y < fc->height; y++) {
+                    memcpy(region + y * canvas_row, saved + y * region_row, region_row);
+                }
+            }
+        }
+    }
+
+    free(canvas);
+    free(saved);
+    free(rgba);
+    free(color);
+    free_APNG_file(apng);
+    free(apng);
+    return shown;
+}
@@ -0,0 +1,71 @@
+#include <stdint.h>
+#include <stddef.h>
+
+//What to do with a frame's region before the next frame is drawn
+//As defined here: https://www.w3.org/TR/png/#fcTL-chunk
+#define APNG_DISPOSE_NONE 0
+#define APNG_DISPOSE_BACKGROUND 1
+#define APNG_DISPOSE_PREVIOUS 2
+
+//How a frame is drawn over the canvas
+#define APNG_BLEND_SOURCE 0
+#define APNG_BLEND_OVER 1
+
+#define APNG_BATCH_FRAMES 4 //frames decoded at once per thread before they are composited
+
+//Frame control chunk
+struct FrameControl {
+    unsigned int sequence;
+    unsigned int width;
+    unsigned int height;
+    unsigned int x_offset;
+    unsigned int y_offset;
+    uint16_t delay_num;     //frame delay is delay_num / delay_den seconds
+    uint16_t delay_den;     //0 means 100
+    uint8_t dispose_op;
+    uint8_t blend_op;
+};
+
+//One frame's compressed data, gathered from its IDAT or fdAT chunks
+struct APNGFrame {
+    struct FrameControl fc;
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+    uint8_t* pixels;    //unfiltered scanlines once decoded
+    struct InflateStats stats;
+};
+
+//Everything read from an APNG file before decoding
+struct APNGFile {
+    struct IHDR ihdr;
+    uint8_t palette[768];
+    int palette_len;
+    uint8_t trns[256];
+    int trns_len;
+    unsigned int num_frames;    //from acTL, 0 if the file has none
+    unsigned int num_plays;     //0 means loop forever
+    struct APNGFrame* frames;
+    int frame_count;
+};
+
+int parse_fcTL(uint8_t* data, unsigned int len, struct IHDR* ihdr, struct FrameControl* fc);
+
+int read_APNG_chunks(char* filepath, struct APNGFile* apng);
+
+void free_APNG_file(struct APNGFile* apng);
+
+//Hands a block of memory to an InflateStream all at once
+struct MemorySource {
+    uint8_t* data;
+    size_t len;
+    int given;
+};
+
+int refill_memory(void* ctx, uint8_t** buf, size_t* len);
+
+void blend_row(uint8_t* dest, uint8_t* src, int width, uint8_t blend_op);
+
+int read_APNG(char* filepath, struct IHDR* ihdr, int first_frame_only, int threads,
+              int (*frame_callback)(void* user, int index, uint8_t* canvas, struct FrameControl* fc), void* user,
+              struct InflateStats* stats);
@@ -0,0 +1,21 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#define ADLER_BASE 65521
+#define ADLER_NMAX 5552
+
+extern uint32_t (*crc32_update)(uint32_t crc, uint8_t* buf, size_t len);
+
+extern uint32_t (*adler32_update)(uint32_t adler, uint8_t* buf, size_t len);
+
+uint32_t crc32_scalar(uint32_t crc, uint8_t* buf, size_t len);
+
+uint32_t adler32_scalar(uint32_t adler, uint8_t* buf, size_t len);
+
+#if defined(__x86_64__) || defined(__i386__)
+uint32_t crc32_pclmul(uint32_t crc, uint8_t* buf, size_t len);
+
+uint32_t adler32_ssse3(uint32_t adler, uint8_t* buf, size_t len);
+
+uint32_t adler32_avx2(uint32_t adler, uint8_t* buf, size_t len);
+#endif
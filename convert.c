@@ -0,0 +1,339 @@
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "convert.h"
+#include "cpu.h"
+
+/**
+ * Sets up the color info for an image
+ * @param struct ColorInfo* info is the info to set
+ * @param uint8_t color_type is the IHDR color type
+ * @param uint8_t bit_depth is the IHDR bit depth
+ * @param uint8_t* palette is the PLTE chunk data or NULL
+ * @param int palette_len is the length of the PLTE chunk data
+ * @param uint8_t* trns is the tRNS chunk data or NULL
+ * @param int trns_len is the length of the tRNS chunk data
+*/
+void init_color_info(struct ColorInfo* info, uint8_t color_type, uint8_t bit_depth, uint8_t* palette, int palette_len, uint8_t* trns, int trns_len) {
+    info->color_type = color_type;
+    info->bit_depth = bit_depth;
+    info->has_key = 0;
+
+    //indices past the end of the palette come out opaque black
+    for (int i = 0; i < 256; i++) {
+        info->palette[i][0] = 0;
+        info->palette[i][1] = 0;
+        info->palette[i][2] = 0;
+        info->palette[i][3] = 255;
+    }
+    for (int i = 0; palette && i < palette_len / 3 && i < 256; i++) {
+        memcpy(info->palette[i], palette + i * 3, 3);
+    }
+    info->convert = row_converter(color_type, bit_depth);
+
+    //greyscale up to 8 bits is looked up like a palette so the kernels handle both the same way
+    if (color_type == 0 && bit_depth <= 8) {
+        for (int i = 0; i < 1 << bit_depth; i++) {
+            memset(info->palette[i], sample_to_8(i, bit_depth), 3);
+        }
+    }
+
+    if (!trns) return;
+    if (color_type == 3) {
+        for (int i = 0; i < trns_len && i < 256; i++) info->palette[i][3] = trns[i];
+    } else if (color_type == 0 && trns_len >= 2) {
+        info->has_key = 1;
+        info->key[0] = (trns[0] << 8) | trns[1];
+        if (bit_depth <= 8 && info->key[0] < 1 << bit_depth) info->palette[info->key[0]][3] = 0;
+    } else if (color_type == 2 && trns_len >= 6) {
+        info->has_key = 1;
+        for (int i = 0; i < 3; i++) info->key[i] = (trns[i * 2] << 8) | trns[i * 2 + 1];
+    }
+}
+
+/**
+ * Reads one sample from a scanline.  Samples below 8 bits are packed from the most significant bit
+ * @param uint8_t* row is the unfiltered scanline
+ * @param int index is which sample to read counting every channel
+ * @param uint8_t bit_depth is the IHDR bit depth
+ * @return the sample value
+*/
+uint16_t get_sample(uint8_t* row, int index, uint8_t bit_depth) {
+    if (bit_depth == 16) return (row[index * 2] << 8) | row[index * 2 + 1];
+    if (bit_depth == 8) return row[index];
+
+    int bit = index * bit_depth;
+    return (row[bit / 8] >> (8 - bit_depth - bit % 8)) & ((1 << bit_depth) - 1);
+}
+
+/**
+ * Scales a sample to 8 bits
+ * @param uint16_t sample is the sample value
+ * @param uint8_t bit_depth is the IHDR bit depth
+ * @return the 8 bit sample
+*/
+uint8_t sample_to_8(uint16_t sample, uint8_t bit_depth) {
+    if (bit_depth == 16) return sample >> 8;
+    if (bit_depth == 8) return sample;
+    return sample * 255 / ((1 << bit_depth) - 1);
+}
+
+/**
+ * Converts an unfiltered scanline of any color type and bit depth to 8 bit RGBA
+ * @param struct ColorInfo* info is the image's color info
+ * @param uint8_t* row is the unfiltered scanline
+ * @param int width is the number of pixels in the scanline
+ * @param uint8_t* out is where the width * 4 RGBA bytes are written
+*/
+void convert_row_RGBA8(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out) {
+    uint8_t depth = info->bit_depth;
+    for (int x = 0; x < width; x++) {
+        uint8_t* px = out + x * 4;
+        if (info->color_type == 0) { //greyscale
+            uint16_t g = get_sample(row, x, depth);
+            px[0] = px[1] = px[2] = sample_to_8(g, depth);
+            px[3] = info->has_key && g == info->key[0] ? 0 : 255;
+        } else if (info->color_type == 2) { //truecolor
+            uint16_t r = get_sample(row, x * 3, depth);
+            uint16_t g = get_sample(row, x * 3 + 1, depth);
+            uint16_t b = get_sample(row, x * 3 + 2, depth);
+            px[0] = sample_to_8(r, depth);
+            px[1] = sample_to_8(g, depth);
+            px[2] = sample_to_8(b, depth);
+            px[3] = info->has_key && r == info->key[0] && g == info->key[1] && b == info->key[2] ? 0 : 255;
+        } else if (info->color_type == 3) { //indexed
+            memcpy(px, info->palette[get_sample(row, x, depth)], 4);
+        } else if (info->color_type == 4) { //greyscale with alpha
+            px[0] = px[1] = px[2] = sample_to_8(get_sample(row, x * 2, depth), depth);
+            px[3] = sample_to_8(get_sample(row, x * 2 + 1, depth), depth);
+        } else { //truecolor with alpha
+            for (int c = 0; c < 4; c++) px[c] = sample_to_8(get_sample(row, x * 4 + c, depth), depth);
+        }
+    }
+}
+
+//Specialized versions of convert_row_RGBA8, one per color type and bit depth.  With both known at compile time
+//the per pixel branching, bit depth math and sample loops all fold away
+
+//Indexed, and greyscale up to 8 bits, as a palette lookup.  Pixels below 8 bits are unpacked a whole byte at a time
+#define DEFINE_LOOKUP_KERNEL(CT, BD) \
+void convert_ct##CT##_bd##BD(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out) { \
+    uint32_t* px = (uint32_t*) out; \
+    int x = 0; \
+    for (; x + 8 / BD <= width; x += 8 / BD, row++) { \
+        uint8_t byte = *row; \
+        for (int i = 0; i < 8 / BD; i++) { \
+            memcpy(px++, info->palette[(uint8_t) (byte << (i * BD)) >> (8 - BD)], 4); \
+        } \
+    } \
+    for (int i = 0; x < width; x++, i++) { \
+        memcpy(px++, info->palette[(uint8_t) (*row << (i * BD)) >> (8 - BD)], 4); \
+    } \
+}
+
+//Every other color type at 8 or 16 bits, keeping the most significant byte of 16 bit samples.  CH is the number of
+//channels and the tRNS key check for greyscale and truecolor only happens when the image has one
+#define DEFINE_DIRECT_KERNEL(CT, BD, CH) \
+void convert_ct##CT##_bd##BD(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out) { \
+    int keyed = info->has_key && (CH == 1 || CH == 3); \
+    for (int x = 0; x < width; x++, row += CH * (BD / 8), out += 4) { \
+        out[0] = row[0]; \
+        out[1] = row[(CH >= 3) * (BD / 8)]; \
+        out[2] = row[(CH >= 3) * 2 * (BD / 8)]; \
+        out[3] = CH == 2 ? row[BD / 8] : (CH == 4 ? row[3 * (BD / 8)] : 255); \
+        if (keyed) { \
+            int match = 1; \
+            for (int c = 0; c < CH; c++) { \
+                uint16_t sample = BD == 16 ? (row[c * 2] << 8) | row[c * 2 + 1] : row[c]; \
+                match &= sample == info->key[c]; \
+            } \
+            if (match) out[3] = 0; \
+        } \
+    } \
+}
+
+DEFINE_LOOKUP_KERNEL(0, 1)
+DEFINE_LOOKUP_KERNEL(0, 2)
+DEFINE_LOOKUP_KERNEL(0, 4)
+DEFINE_LOOKUP_KERNEL(0, 8)
+DEFINE_DIRECT_KERNEL(0, 16, 1)
+DEFINE_DIRECT_KERNEL(2, 8, 3)
+DEFINE_DIRECT_KERNEL(2, 16, 3)
+DEFINE_LOOKUP_KERNEL(3, 1)
+DEFINE_LOOKUP_KERNEL(3, 2)
+DEFINE_LOOKUP_KERNEL(3, 4)
+DEFINE_LOOKUP_KERNEL(3, 8)
+DEFINE_DIRECT_KERNEL(4, 8, 2)
+DEFINE_DIRECT_KERNEL(4, 16, 2)
+DEFINE_DIRECT_KERNEL(6, 16, 4)
+
+/**
+ * Converts an unfiltered 8 bit truecolor with alpha scanline, which is already 8 bit RGBA
+ * @param struct ColorInfo* info is the image's color info
+ * @param uint8_t* row is the unfiltered scanline
+ * @param int width is the number of pixels in the scanline
+ * @param uint8_t* out is where the width * 4 RGBA bytes are written
+*/
+void convert_ct6_bd8(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out) {
+    (void) info;
+    memcpy(out, row, (size_t) width * 4);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * convert_ct2_bd8 with SSSE3, spreading 4 RGB pixels to RGBA with one shuffle.  Images with a tRNS key go to
+ * convert_ct2_bd8
+ * @param struct ColorInfo* info is the image's color info
+ * @param uint8_t* row is the unfiltered scanline
+ * @param int width is the number of pixels in the scanline
+ * @param uint8_t* out is where the width * 4 RGBA bytes are written
+*/
+__attribute__((target("ssse3")))
+void convert_ct2_bd8_ssse3(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out) {
+    int x = 0;
+    if (!info->has_key) {
+        __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+        __m128i alpha = _mm_set1_epi32(0xff000000);
+        for (; x + 6 <= width; x += 4) { //16 bytes are read for the 12 used so stay 2 pixels from the end
+            __m128i rgb = _mm_loadu_si128((__m128i*) (row + x * 3));
+            _mm_storeu_si128((__m128i*) (out + x * 4), _mm_or_si128(_mm_shuffle_epi8(rgb, spread), alpha));
+        }
+    }
+    convert_ct2_bd8(info, row + x * 3, width - x, out + x * 4);
+}
+
+/**
+ * convert_ct4_bd8 with SSSE3, spreading 8 grey alpha pixels to RGBA with two shuffles
+ * @param struct ColorInfo* info is the image's color info
+ * @param uint8_t* row is the unfiltered scanline
+ * @param int width is the number of pixels in the scanline
+ * @param uint8_t* out is where the width * 4 RGBA bytes are written
+*/
+__attribute__((target("ssse3")))
+void convert_ct4_bd8_ssse3(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out) {
+    __m128i spread_lo = _mm_setr_epi8(0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6, 7);
+    __m128i spread_hi = _mm_setr_epi8(8, 8, 8, 9, 10, 10, 10, 11, 12, 12, 12, 13, 14, 14, 14, 15);
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i ga = _mm_loadu_si128((__m128i*) (row + x * 2));
+        _mm_storeu_si128((__m128i*) (out + x * 4), _mm_shuffle_epi8(ga, spread_lo));
+        _mm_storeu_si128((__m128i*) (out + x * 4 + 16), _mm_shuffle_epi8(ga, spread_hi));
+    }
+    convert_ct4_bd8(info, row + x * 2, width - x, out + x * 4);
+}
+
+/**
+ * convert_ct6_bd16 with SSSE3, gathering the most significant bytes of 4 pixels with two shuffles
+ * @param struct ColorInfo* info is the image's color info
+ * @param uint8_t* row is the unfiltered scanline
+ * @param int width is the number of pixels in the scanline
+ * @param uint8_t* out is where the width * 4 RGBA bytes are written
+*/
+__attribute__((target("ssse3")))
+void convert_ct6_bd16_ssse3(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out) {
+    __m128i high_bytes = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1);
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*) (row + x * 8)), high_bytes);
+        __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*) (row + x * 8 + 16)), high_bytes);
+        _mm_storeu_si128((__m128i*) (out + x * 4), _mm_unpacklo_epi64(lo, hi));
+    }
+    convert_ct6_bd16(info, row + x * 8, width - x, out + x * 4);
+}
+/**
+ * sum_premultiplied_scalar with SSE2, 4 pixels at a time.  Products fit in 16 bits and are summed in 32 bits for up
+ * to 65536 pixels before going into the 64 bit sums
+ * @param uint8_t* rgba is the pixels
+ * @param int count is the number of pixels
+ * @param uint64_t sums[4] has red * alpha, green * alpha, blue * alpha and alpha added to it
+*/
+__attribute__((target("sse2")))
+void sum_premultiplied_sse2(uint8_t* rgba, int count, uint64_t sums[4]) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i alpha_lanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    __m128i alpha_ones = _mm_set_epi16(1, 0, 0, 0, 1, 0, 0, 0);
+    while (count >= 4) {
+        int blocks = count / 4 < 16384 ? count / 4 : 16384;
+        count -= blocks * 4;
+        __m128i acc = zero;
+        while (blocks--) {
+            __m128i px = _mm_loadu_si128((__m128i*) rgba);
+            __m128i lo = _mm_unpacklo_epi8(px, zero);
+            __m128i hi = _mm_unpackhi_epi8(px, zero);
+
+            //multiply each pixel by (alpha, alpha, alpha, 1)
+            __m128i lo_alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xff), 0xff);
+            __m128i hi_alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xff), 0xff);
+            lo = _mm_mullo_epi16(lo, _mm_or_si128(_mm_andnot_si128(alpha_lanes, lo_alpha), alpha_ones));
+            hi = _mm_mullo_epi16(hi, _mm_or_si128(_mm_andnot_si128(alpha_lanes, hi_alpha), alpha_ones));
+
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero)));
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)));
+            rgba += 16;
+        }
+
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i*) lanes, acc);
+        for (int c = 0; c < 4; c++) sums[c] += lanes[c];
+    }
+    sum_premultiplied_scalar(rgba, count, sums);
+}
+#endif
+
+//Points at the fastest version init_cpu_dispatch finds for this CPU
+void (*sum_premultiplied)(uint8_t* rgba, int count, uint64_t sums[4]) = sum_premultiplied_scalar;
+
+/**
+ * Adds RGBA pixels to running sums with each color multiplied by its alpha, so averaging them does not let the color
+ * of transparent pixels bleed in
+ * @param uint8_t* rgba is the pixels
+ * @param int count is the number of pixels
+ * @param uint64_t sums[4] has red * alpha, green * alpha, blue * alpha and alpha added to it
+*/
+void sum_premultiplied_scalar(uint8_t* rgba, int count, uint64_t sums[4]) {
+    for (int x = 0; x < count; x++, rgba += 4) {
+        sums[0] += rgba[0] * rgba[3];
+        sums[1] += rgba[1] * rgba[3];
+        sums[2] += rgba[2] * rgba[3];
+        sums[3] += rgba[3];
+    }
+}
+
+/**
+ * Picks the conversion kernel for a color type and bit depth, using the SSSE3 ones when the CPU has it.
+ * Done once per image from the IHDR
+ * @param uint8_t color_type is the IHDR color type
+ * @param uint8_t bit_depth is the IHDR bit depth
+ * @return the kernel, convert_row_RGBA8 if the combination has none
+*/
+void (*row_converter(uint8_t color_type, uint8_t bit_depth))(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out) {
+    init_cpu_dispatch();
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu_features.ssse3) {
+        if (color_type == 2 && bit_depth == 8) return convert_ct2_bd8_ssse3;
+        if (color_type == 4 && bit_depth == 8) return convert_ct4_bd8_ssse3;
+        if (color_type == 6 && bit_depth == 16) return convert_ct6_bd16_ssse3;
+    }
+#endif
+    switch (color_type * 32 + bit_depth) {
+        case 0 * 32 + 1: return convert_ct0_bd1;
+        case 0 * 32 + 2: return convert_ct0_bd2;
+        case 0 * 32 + 4: return convert_ct0_bd4;
+        case 0 * 32 + 8: return convert_ct0_bd8;
+        case 0 * 32 + 16: return convert_ct0_bd16;
+        case 2 * 32 + 8: return convert_ct2_bd8;
+        case 2 * 32 + 16: return convert_ct2_bd16;
+        case 3 * 32 + 1: return convert_ct3_bd1;
+        case 3 * 32 + 2: return convert_ct3_bd2;
+        case 3 * 32 + 4: return convert_ct3_bd4;
+        case 3 * 32 + 8: return convert_ct3_bd8;
+        case 4 * 32 + 8: return convert_ct4_bd8;
+        case 4 * 32 + 16: return convert_ct4_bd16;
+        case 6 * 32 + 8: return convert_ct6_bd8;
+        case 6 * 32 + 16: return convert_ct6_bd16;
+        default: return convert_row_RGBA8;
+    }
+}
@@ -0,0 +1,35 @@
+#include <stdint.h>
+
+//What convert_row_RGBA8 needs to know about the image's pixels
+struct ColorInfo {
+    uint8_t color_type;
+    uint8_t bit_depth;
+    uint8_t palette[256][4];    //RGBA with the alpha from tRNS.  Also filled with the grey levels for greyscale up to 8 bits
+    int has_key;                //true if tRNS gives a transparent color for color types 0 and 2
+    uint16_t key[3];            //the transparent sample values
+    void (*convert)(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out);    //kernel picked for this color type and bit depth
+};
+
+void init_color_info(struct ColorInfo* info, uint8_t color_type, uint8_t bit_depth, uint8_t* palette, int palette_len, uint8_t* trns, int trns_len);
+
+uint16_t get_sample(uint8_t* row, int index, uint8_t bit_depth);
+
+uint8_t sample_to_8(uint16_t sample, uint8_t bit_depth);
+
+void convert_row_RGBA8(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out);
+
+void (*row_converter(uint8_t color_type, uint8_t bit_depth))(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out);
+
+extern void (*sum_premultiplied)(uint8_t* rgba, int count, uint64_t sums[4]);
+
+void sum_premultiplied_scalar(uint8_t* rgba, int count, uint64_t sums[4]);
+
+#if defined(__x86_64__) || defined(__i386__)
+void sum_premultiplied_sse2(uint8_t* rgba, int count, uint64_t sums[4]);
+
+void convert_ct2_bd8_ssse3(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out);
+
+void convert_ct4_bd8_ssse3(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out);
+
+void convert_ct6_bd16_ssse3(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out);
+#endif
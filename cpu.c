@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "cpu.h"
+#include "checksum.h"
+#include "filter.h"
+#include "huffman.h"
+#include "deflate.h"
+#include "inflate.h"
+#include "convert.h"
+
+struct CPUFeatures cpu_features;
+pthread_once_t cpu_dispatch_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Finds which instruction sets the CPU and OS support using CPUID
+ * @param struct CPUFeatures* features is set to the supported instruction sets
+*/
+void detect_cpu_features(struct CPUFeatures* features) {
+    memset(features, 0, sizeof(struct CPUFeatures));
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return;
+    features->sse2 = (edx & bit_SSE2) != 0;
+    features->ssse3 = (ecx & bit_SSSE3) != 0;
+    features->sse41 = (ecx & bit_SSE4_1) != 0;
+    features->pclmul = (ecx & bit_PCLMUL) != 0;
+
+    //AVX2 also needs the OS to save the upper halves of the registers
+    int avx_os = 0;
+    if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+        uint32_t xcr0_lo, xcr0_hi;
+        __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        avx_os = (xcr0_lo & 6) == 6;
+    }
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        features->avx2 = avx_os && (ebx & bit_AVX2) != 0;
+        features->bmi2 = (ebx & bit_BMI2) != 0;
+    }
+#endif
+}
+
+/**
+ * Turns off the instruction sets listed in PNG_DISABLE_SIMD, a comma separated list of
+ * sse2, ssse3, sse41, avx2, pclmul and bmi2.  "all" turns every one off and leaves only the scalar code.  Names
+ * must match exactly.  Any other name is warned about and ignored
+ * @param struct CPUFeatures* features is the detected instruction sets
+*/
+void apply_simd_overrides(struct CPUFeatures* features) {
+    char* list = getenv("PNG_DISABLE_SIMD");
+    if (list == NULL) return;
+
+    char* names[6] = {"sse2", "ssse3", "sse41", "avx2", "pclmul", "bmi2"};
+    int* flags[6] = {&features->sse2, &features->ssse3, &features->sse41, &features->avx2, &features->pclmul, &features->bmi2};
+    char* name = list;
+    while (1) {
+        size_t len = strcspn(name, ",");
+        int all = len == 3 && !strncmp(name, "all", 3);
+        int known = all;
+        for (int i = 0; i < 6; i++) {
+            if (all || (strlen(names[i]) == len && !strncmp(name, names[i], len))) {
+                *flags[i] = 0;
+                known = 1;
+            }
+        }
+        if (!known && len) fprintf(stderr, "UNKNOWN INSTRUCTION SET '%.*s' IN PNG_DISABLE_SIMD\n", (int) len, name);
+
+        if (name[len] == '\0') break;
+        name += len + 1;
+    }
+}
+
+/**
+ * Detects the CPU and points every dispatched function at the best version it can run
+*/
+void bind_cpu_functions() {
+    detect_cpu_features(&cpu_features);
+    apply_simd_overrides(&cpu_features);
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu_features.pclmul && cpu_features.sse41) crc32_update = crc32_pclmul;
+
+    if (cpu_features.avx2) {
+        adler32_update = adler32_avx2;
+    } else if (cpu_features.ssse3) {
+        adler32_update = adler32_ssse3;
+    }
+
+    if (cpu_features.sse2) {
+        unfilter_row = unfilter_row_sse2;
+        copy_match = copy_match_sse2;
+        sum_premultiplied = sum_premultiplied_sse2;
+    }
+
+    if (cpu_features.bmi2) stream_decode_sym = stream_decode_sym_bmi2;
+#endif
+    //the conversion kernels are picked per image by row_converter
+}
+
+/**
+ * Binds the dispatched functions the first time it is called.  Safe to call from any thread as often as wanted.
+ * Until it is called everything runs the scalar code
+*/
+void init_cpu_dispatch() {
+    pthread_once(&cpu_dispatch_once, bind_cpu_functions);
+}
+
+/**
+ * Prints which instruction sets the dispatched functions are using
+ * @param FILE* fp is where to print
+*/
+void report_cpu_dispatch(FILE* fp) {
+    init_cpu_dispatch();
+    fprintf(fp, "CPU dispatch: sse2 %d, ssse3 %d, sse41 %d, avx2 %d, pclmul %d, bmi2 %d\n",
+            cpu_features.sse2, cpu_features.ssse3, cpu_features.sse41, cpu_features.avx2, cpu_features.pclmul, cpu_features.bmi2);
+}
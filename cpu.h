@@ -0,0 +1,21 @@
+#include <stdio.h>
+
+//Instruction sets found on this CPU.  Anything turned off with PNG_DISABLE_SIMD reads as 0
+struct CPUFeatures {
+    int sse2;
+    int ssse3;
+    int sse41;
+    int avx2;
+    int pclmul;
+    int bmi2;
+};
+
+extern struct CPUFeatures cpu_features;
+
+void detect_cpu_features(struct CPUFeatures* features);
+
+void apply_simd_overrides(struct CPUFeatures* features);
+
+void init_cpu_dispatch();
+
+void report_cpu_dispatch(FILE* fp);
@@ -0,0 +1,33 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "huffman.h"
+#include "deflate.h"
+#include "inflate.h"
+#include "filter.h"
+#include "png.h"
+
+/**
+ * Decodes the PNG given on the command line and prints its header and how well the Huffman tree cache did
+ * @param int argc is the number of arguments
+ * @param char** argv is the arguments, argv[1] being the PNG file's path
+ * @return 1 if error occurs 0 otherwise
+*/
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "USAGE: decode FILE.png\n");
+        return 1;
+    }
+
+    struct IHDR ihdr;
+    struct InflateStats stats;
+    uint8_t* image = read_PNG_image(argv[1], &ihdr, 0, NULL, NULL, &stats);
+    if (image == NULL) return 1;
+
+    printf("%s: %u x %u, bit depth %d, color type %d%s\n", argv[1], ihdr.width, ihdr.height, ihdr.bit_depth,
+           ihdr.color_type, ihdr.interlace ? ", interlaced" : "");
+    report_tree_cache(&stats, stdout);
+    free(image);
+    return 0;
+}
@@ -1,5 +1,13 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
 #include "huffman.h"
 #include "deflate.h"
+#include "checksum.h"
+#include "pool.h"
+#include "cpu.h"
 
 
 /**
@@ -34,4 +42,1103 @@ void make_BT_ONE_distance_code(struct CodeLength tree[32]) {
        bit_lengths[i] = 5;
     }
     generate_codes_from_bl(bit_lengths, len, tree);
-}
\ No newline at end of file
+}
+//Base lengths and extra bits for length symbols 257 to 285
+int length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+int length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+
+//Base distances and extra bits for distance symbols 0 to 29
+int distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+int distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+//Order the code length code lengths are written in (3.2.7)
+int code_length_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+/**
+ * Returns the length symbol index (symbol - 257) for a match length
+ * @param int length is the match length from 3 to 258
+ * @return the index into length_base
+*/
+int length_to_sym(int length) {
+    int sym = 28;
+    while (length < length_base[sym]) sym--;
+    return sym;
+}
+
+/**
+ * Returns the distance symbol for a match distance
+ * @param int distance is the match distance from 1 to 32768
+ * @return the index into distance_base
+*/
+int distance_to_sym(int distance) {
+    if (distance <= 4) return distance - 1;
+    unsigned int d = distance - 1;
+    int log = 0;
+    while (d >> (log + 1)) log++; //floor(log2(d))
+    return 2 * log + ((d >> (log - 1)) & 1);
+}
+
+/**
+ * Writes bits to the stream starting with the least significant bit (3.1.1)
+ * @param struct BitWriter* bw is the output stream
+ * @param uint32_t value holds the bits to write
+ * @param int num_bits is the number of bits of value to write
+*/
+void write_bits(struct BitWriter* bw, uint32_t value, int num_bits) {
+    for (int i = 0; i < num_bits; i++) {
+        if (bw->bit == 0) {
+            if (bw->len == bw->cap) {
+                bw->cap = bw->cap ? bw->cap * 2 : 1024;
+                bw->data = realloc(bw->data, bw->cap);
+            }
+            bw->data[bw->len++] = 0;
+        }
+        bw->data[bw->len - 1] |= ((value >> i) & 1) << bw->bit;
+        bw->bit = (bw->bit + 1) % 8;
+    }
+}
+
+/**
+ * Writes a prefix code to the stream.  Prefix codes are packed starting with their most significant bit (3.1.1)
+ * @param struct BitWriter* bw is the output stream
+ * @param struct CodeLength code is the code to write
+*/
+void write_code(struct BitWriter* bw, struct CodeLength code) {
+    for (int i = code.Len - 1; i >= 0; i--) {
+        write_bits(bw, (code.Code >> i) & 1, 1);
+    }
+}
+
+/**
+ * Adds a token to the end of a token list
+ * @param struct TokenList* list is the list to add to
+ * @param int litlen is the literal byte or the match length
+ * @param int dist is the match distance or 0 for a literal
+*/
+void add_token(struct TokenList* list, int litlen, int dist) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 1024;
+        list->tokens = realloc(list->tokens, list->cap * sizeof(struct LZ77Token));
+    }
+    list->tokens[list->count].litlen = litlen;
+    list->tokens[list->count].dist = dist;
+    list->count++;
+}
+
+/**
+ * Hashes the 3 bytes that start a match
+ * @param uint8_t* data is the first of the 3 bytes
+ * @return the hash from 0 to HASH_SIZE - 1
+*/
+int hash3(uint8_t* data) {
+    uint32_t v = ((uint32_t) data[0] << 16) | (data[1] << 8) | data[2];
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/**
+ * Walks the hash chain for one position and caches the closest distance for every longer match found.
+ * Matches never run past the end of the cache
+ * @param struct MatchCache* cache is the cache to fill
+ * @param size_t pos is the position to find matches for
+*/
+void find_matches(struct MatchCache* cache, size_t pos) {
+    struct LZ77Token found[MAX_MATCH];
+    int num_found = 0;
+    uint8_t* cur = cache->data + pos;
+    int limit = cache->end - pos < MAX_MATCH ? cache->end - pos : MAX_MATCH;
+    int best = MIN_MATCH - 1;
+
+    int cand = limit >= MIN_MATCH ? cache->prev[pos - cache->region_start] : -1;
+    for (int chain = 0; cand >= 0 && chain < MAX_CHAIN; chain++) {
+        size_t cand_pos = cache->region_start + cand;
+        size_t dist = pos - cand_pos;
+        if (dist > WINDOW_SIZE) break;
+
+        uint8_t* prev = cache->data + cand_pos;
+        if (prev[best] == cur[best]) {
+            int len = 0;
+            while (len < limit && prev[len] == cur[len]) len++;
+            if (len > best) {
+                found[num_found].litlen = len;
+                found[num_found].dist = dist;
+                num_found++;
+                best = len;
+                if (len == limit) break;
+            }
+        }
+        cand = cache->prev[cand];
+    }
+
+    //drop shorter matches whose distance costs the same as the next longer one.  Those lengths use the longer match instead
+    int kept = 0;
+    for (int i = 0; i < num_found; i++) {
+        if (i + 1 < num_found && distance_to_sym(found[i].dist) == distance_to_sym(found[i + 1].dist)) continue;
+        found[kept++] = found[i];
+    }
+    int first = kept > MATCH_CACHE_LEN ? kept - MATCH_CACHE_LEN : 0; //keep the longest ones if there are too many
+
+    struct LZ77Token* slot = cache->matches + (pos - cache->start) * MATCH_CACHE_LEN;
+    for (int i = first; i < kept; i++) {
+        slot[i - first] = found[i];
+    }
+    cache->match_count[pos - cache->start] = kept - first;
+}
+
+/**
+ * Job for run_jobs that fills one MATCH_JOB_SIZE range of the cache
+ * @param void* ctx is the struct MatchCache*
+ * @param int index is the range to fill
+*/
+void find_matches_job(void* ctx, int index) {
+    struct MatchCache* cache = ctx;
+    size_t start = cache->start + (size_t) index * MATCH_JOB_SIZE;
+    size_t end = start + MATCH_JOB_SIZE < cache->end ? start + MATCH_JOB_SIZE : cache->end;
+    for (size_t pos = start; pos < end; pos++) {
+        find_matches(cache, pos);
+    }
+}
+
+/**
+ * Finds the matches for every position in [start, end).  Matches may reach back to WINDOW_SIZE before start
+ * @param struct MatchCache* cache is the cache to fill
+ * @param uint8_t* data is the whole input
+ * @param size_t data_len is the length of the whole input
+ * @param size_t start is the first position to cache
+ * @param size_t end is one past the last position to cache
+ * @param int threads is the number of threads to search with
+*/
+void build_match_cache(struct MatchCache* cache, uint8_t* data, size_t data_len, size_t start, size_t end, int threads) {
+    cache->data = data;
+    cache->start = start;
+    cache->end = end;
+    cache->region_start = start > WINDOW_SIZE ? start - WINDOW_SIZE : 0;
+    cache->prev = malloc((end - cache->region_start) * sizeof(int));
+    cache->matches = malloc((end - start) * MATCH_CACHE_LEN * sizeof(struct LZ77Token));
+    cache->match_count = malloc(end - start);
+    cache->same = malloc((end - start) * sizeof(uint16_t));
+
+    //build every chain first so positions can be searched in parallel
+    int* head = malloc(HASH_SIZE * sizeof(int));
+    for (int i = 0; i < HASH_SIZE; i++) head[i] = -1;
+    for (size_t pos = cache->region_start; pos < end; pos++) {
+        int rel = pos - cache->region_start;
+        if (pos + MIN_MATCH <= data_len) {
+            int h = hash3(data + pos);
+            cache->prev[rel] = head[h];
+            head[h] = rel;
+        } else {
+            cache->prev[rel] = -1;
+        }
+    }
+    free(head);
+
+    //length of the run of identical bytes starting at each position
+    for (size_t pos = end; pos-- > start;) {
+        uint16_t run = 1;
+        if (pos + 1 < end && data[pos + 1] == data[pos] && cache->same[pos + 1 - start] < 65535) {
+            run = cache->same[pos + 1 - start] + 1;
+        }
+        cache->same[pos - start] = run;
+    }
+
+    int jobs = (end - start + MATCH_JOB_SIZE - 1) / MATCH_JOB_SIZE;
+    run_jobs(threads, jobs, find_matches_job, cache);
+}
+
+/**
+ * Frees everything allocated by build_match_cache
+ * @param struct MatchCache* cache is the cache to free
+*/
+void free_match_cache(struct MatchCache* cache) {
+    free(cache->prev);
+    free(cache->matches);
+    free(cache->match_count);
+    free(cache->same);
+}
+
+/**
+ * Gets the longest cached match at pos that ends before end
+ * @param struct MatchCache* cache is the match cache
+ * @param size_t pos is the position to look at
+ * @param size_t end is the end of the block
+ * @param int* dist is set to the match distance
+ * @return the match length or 0 if there is no match of at least MIN_MATCH
+*/
+int longest_match(struct MatchCache* cache, size_t pos, size_t end, int* dist) {
+    int count = cache->match_count[pos - cache->start];
+    if (!count) return 0;
+
+    struct LZ77Token best = cache->matches[(pos - cache->start) * MATCH_CACHE_LEN + count - 1];
+    int len = best.litlen;
+    int left = end - pos < MAX_MATCH ? (int) (end - pos) : MAX_MATCH;
+    if (len > left) len = left;
+    *dist = best.dist;
+    return len >= MIN_MATCH ? len : 0;
+}
+
+/**
+ * Parses [start, end) taking the longest match unless the next byte starts a longer one.  Used to seed the optimal parse
+ * @param struct MatchCache* cache is the match cache
+ * @param size_t start is the first byte of the block
+ * @param size_t end is one past the last byte of the block
+ * @param struct TokenList* out is the list the tokens are added to
+*/
+void lazy_parse(struct MatchCache* cache, size_t start, size_t end, struct TokenList* out) {
+    size_t pos = start;
+    while (pos < end) {
+        int dist;
+        int len = longest_match(cache, pos, end, &dist);
+        if (len && pos + 1 < end) {
+            int next_dist;
+            if (longest_match(cache, pos + 1, end, &next_dist) > len) len = 0;
+        }
+
+        if (len) {
+            add_token(out, len, dist);
+            pos += len;
+        } else {
+            add_token(out, cache->data[pos], 0);
+            pos++;
+        }
+    }
+}
+
+/**
+ * Counts how often each LL and distance symbol is used by a range of tokens.  The end of block symbol is counted once
+ * @param struct LZ77Token* tokens is the token list
+ * @param size_t start is the first token
+ * @param size_t end is one past the last token
+ * @param int ll_counts[288] is set to the count of each LL symbol
+ * @param int d_counts[30] is set to the count of each distance symbol
+*/
+void count_symbols(struct LZ77Token* tokens, size_t start, size_t end, int ll_counts[288], int d_counts[30]) {
+    memset(ll_counts, 0, 288 * sizeof(int));
+    memset(d_counts, 0, 30 * sizeof(int));
+    for (size_t i = start; i < end; i++) {
+        if (tokens[i].dist) {
+            ll_counts[257 + length_to_sym(tokens[i].litlen)]++;
+            d_counts[distance_to_sym(tokens[i].dist)]++;
+        } else {
+            ll_counts[tokens[i].litlen]++;
+        }
+    }
+    ll_counts[256] = 1;
+}
+
+/**
+ * Returns the number of extra bits written after the length and distance codes
+ * @param int ll_counts[288] is the count of each LL symbol
+ * @param int d_counts[30] is the count of each distance symbol
+ * @return the number of extra bits
+*/
+size_t extra_bits(int ll_counts[288], int d_counts[30]) {
+    size_t bits = 0;
+    for (int i = 0; i < 29; i++) bits += (size_t) ll_counts[257 + i] * length_extra[i];
+    for (int i = 0; i < 30; i++) bits += (size_t) d_counts[i] * distance_extra[i];
+    return bits;
+}
+
+/**
+ * Builds the length limited code lengths for a dynamic block.
+ * The distance code is given at least 2 codes since some decoders reject a distance code with fewer
+ * @param int ll_counts[288] is the count of each LL symbol
+ * @param int d_counts[30] is the count of each distance symbol
+ * @param int ll_lengths[288] is set to the LL code lengths
+ * @param int d_lengths[30] is set to the distance code lengths
+*/
+void dynamic_lengths(int ll_counts[288], int d_counts[30], int ll_lengths[288], int d_lengths[30]) {
+    int* ll = huffman_length_limited(ll_counts, 288, 15);
+    int* d = huffman_length_limited(d_counts, 30, 15);
+    memcpy(ll_lengths, ll, 288 * sizeof(int));
+    memcpy(d_lengths, d, 30 * sizeof(int));
+    free(ll);
+    free(d);
+
+    int used = 0;
+    for (int i = 0; i < 30; i++) used += d_lengths[i] != 0;
+    if (used == 0) {
+        d_lengths[0] = 1;
+        d_lengths[1] = 1;
+    } else if (used == 1) {
+        d_lengths[d_lengths[0] ? 1 : 0] = 1;
+    }
+}
+
+/**
+ * Run length encodes the code lengths of a dynamic block with the code length alphabet and returns its size.
+ * Optionally writes it (3.2.7)
+ * @param int* lengths is the LL code lengths followed by the distance code lengths
+ * @param int hlit is the number of LL code lengths
+ * @param int hdist is the number of distance code lengths
+ * @param int use_16 is true if symbol 16 (repeat previous) may be used
+ * @param int use_17 is true if symbol 17 (short run of zeros) may be used
+ * @param int use_18 is true if symbol 18 (long run of zeros) may be used
+ * @param struct BitWriter* bw is the stream to write to or NULL to only get the size
+ * @return the size of the header in bits not counting the 3 bit block header
+*/
+size_t rle_tree_header(int* lengths, int hlit, int hdist, int use_16, int use_17, int use_18, struct BitWriter* bw) {
+    int n = hlit + hdist;
+    int* syms = malloc(n * sizeof(int));
+    int* extras = malloc(n * sizeof(int));
+    int num_syms = 0;
+    int cl_counts[19] = {0};
+
+    for (int i = 0; i < n;) {
+        int run = 1;
+        while (i + run < n && lengths[i + run] == lengths[i]) run++;
+
+        if (lengths[i] == 0 && (use_17 || use_18) && run >= 3) {
+            while (run >= 3) {
+                int count = run;
+                if (use_18 && count >= 11) {
+                    if (count > 138) count = 138;
+                    syms[num_syms] = 18;
+                    extras[num_syms++] = count - 11;
+                } else if (use_17) {
+                    if (count > 10) count = 10;
+                    syms[num_syms] = 17;
+                    extras[num_syms++] = count - 3;
+                } else {
+                    break;
+                }
+                cl_counts[syms[num_syms - 1]]++;
+                run -= count;
+                i += count;
+            }
+        } else if (lengths[i] != 0 && use_16 && run >= 4) {
+            //first copy literally then repeat it
+            syms[num_syms] = lengths[i];
+            extras[num_syms++] = 0;
+            cl_counts[lengths[i]]++;
+            run--;
+            i++;
+            while (run >= 3) {
+                int count = run > 6 ? 6 : run;
+                syms[num_syms] = 16;
+                extras[num_syms++] = count - 3;
+                cl_counts[16]++;
+                run -= count;
+                i += count;
+            }
+        }
+
+        //whatever is left of the run is written literally
+        while (run > 0) {
+            syms[num_syms] = lengths[i];
+            extras[num_syms++] = 0;
+            cl_counts[lengths[i]]++;
+            run--;
+            i++;
+        }
+    }
+
+    int* cl_lengths = huffman_length_limited(cl_counts, 19, 7);
+
+    //decoders reject an incomplete code length code so a lone symbol gets a partner
+    int used = 0;
+    for (int i = 0; i < 19; i++) used += cl_lengths[i] != 0;
+    if (used == 1) cl_lengths[cl_lengths[0] ? 1 : 0] = 1;
+
+    int hclen = 19;
+    while (hclen > 4 && cl_lengths[code_length_order[hclen - 1]] == 0) hclen--;
+
+    size_t bits = 14 + hclen * 3;
+    for (int i = 0; i < num_syms; i++) {
+        bits += cl_lengths[syms[i]];
+        if (syms[i] == 16) bits += 2;
+        if (syms[i] == 17) bits += 3;
+        if (syms[i] == 18) bits += 7;
+    }
+
+    if (bw) {
+        struct CodeLength cl_tree[19] = {{0}};
+        generate_codes_from_bl(cl_lengths, 19, cl_tree);
+
+        write_bits(bw, hlit - 257, 5);
+        write_bits(bw, hdist - 1, 5);
+        write_bits(bw, hclen - 4, 4);
+        for (int i = 0; i < hclen; i++) {
+            write_bits(bw, cl_lengths[code_length_order[i]], 3);
+        }
+        for (int i = 0; i < num_syms; i++) {
+            write_code(bw, cl_tree[syms[i]]);
+            if (syms[i] == 16) write_bits(bw, extras[i], 2);
+            if (syms[i] == 17) write_bits(bw, extras[i], 3);
+            if (syms[i] == 18) write_bits(bw, extras[i], 7);
+        }
+    }
+
+    free(cl_lengths);
+    free(syms);
+    free(extras);
+    return bits;
+}
+
+/**
+ * Finds the smallest way to run length encode the code lengths of a dynamic block and optionally writes it
+ * @param int ll_lengths[288] is the LL code lengths
+ * @param int d_lengths[30] is the distance code lengths
+ * @param struct BitWriter* bw is the stream to write to or NULL to only get the size
+ * @return the size of the header in bits not counting the 3 bit block header
+*/
+size_t tree_header(int ll_lengths[288], int d_lengths[30], struct BitWriter* bw) {
+    int hlit = 286;
+    int hdist = 30;
+    while (hlit > 257 && ll_lengths[hlit - 1] == 0) hlit--;
+    while (hdist > 1 && d_lengths[hdist - 1] == 0) hdist--;
+
+    int lengths[286 + 30];
+    memcpy(lengths, ll_lengths, hlit * sizeof(int));
+    memcpy(lengths + hlit, d_lengths, hdist * sizeof(int));
+
+    //try every combination of the repeat symbols
+    size_t best_bits = 0;
+    int best = 0;
+    for (int i = 0; i < 8; i++) {
+        size_t bits = rle_tree_header(lengths, hlit, hdist, i & 1, i & 2, i & 4, NULL);
+        if (i == 0 || bits < best_bits) {
+            best_bits = bits;
+            best = i;
+        }
+    }
+
+    if (bw) rle_tree_header(lengths, hlit, hdist, best & 1, best & 2, best & 4, bw);
+    return best_bits;
+}
+
+/**
+ * Returns the size in bits of a block of type 2
+ * @param int ll_counts[288] is the count of each LL symbol
+ * @param int d_counts[30] is the count of each distance symbol
+ * @return the block size in bits including the 3 bit block header
+*/
+size_t dynamic_block_bits(int ll_counts[288], int d_counts[30]) {
+    int ll_lengths[288];
+    int d_lengths[30];
+    dynamic_lengths(ll_counts, d_counts, ll_lengths, d_lengths);
+
+    size_t bits = 3 + tree_header(ll_lengths, d_lengths, NULL) + extra_bits(ll_counts, d_counts);
+    for (int i = 0; i < 288; i++) bits += (size_t) ll_counts[i] * ll_lengths[i];
+    for (int i = 0; i < 30; i++) bits += (size_t) d_counts[i] * d_lengths[i];
+    return bits;
+}
+
+/**
+ * Returns the size in bits of a block of type 1
+ * @param int ll_counts[288] is the count of each LL symbol
+ * @param int d_counts[30] is the count of each distance symbol
+ * @return the block size in bits including the 3 bit block header
+*/
+size_t fixed_block_bits(int ll_counts[288], int d_counts[30]) {
+    size_t bits = 3 + extra_bits(ll_counts, d_counts);
+    for (int i = 0; i < 288; i++) {
+        int len = i < 144 ? 8 : (i < 256 ? 9 : (i < 280 ? 7 : 8));
+        bits += (size_t) ll_counts[i] * len;
+    }
+    for (int i = 0; i < 30; i++) bits += (size_t) d_counts[i] * 5;
+    return bits;
+}
+
+/**
+ * Returns the size in bits of storing bytes in blocks of type 0.  Assumes the worst case padding
+ * @param size_t bytes is the number of bytes to store
+ * @return the size in bits of every block needed
+*/
+size_t stored_block_bits(size_t bytes) {
+    size_t blocks = bytes ? (bytes + BLOCK_ZERO_MAX - 1) / BLOCK_ZERO_MAX : 1;
+    return blocks * 40 + bytes * 8;
+}
+
+/**
+ * Returns the size in bits of the smallest block type for a range of tokens
+ * @param struct LZ77Token* tokens is the token list
+ * @param size_t start is the first token
+ * @param size_t end is one past the last token
+ * @param size_t bytes is the number of uncompressed bytes the tokens hold
+ * @return the block size in bits
+*/
+size_t block_bits(struct LZ77Token* tokens, size_t start, size_t end, size_t bytes) {
+    int ll_counts[288];
+    int d_counts[30];
+    count_symbols(tokens, start, end, ll_counts, d_counts);
+
+    size_t bits = dynamic_block_bits(ll_counts, d_counts);
+    size_t fixed = fixed_block_bits(ll_counts, d_counts);
+    size_t stored = stored_block_bits(bytes);
+    if (fixed < bits) bits = fixed;
+    if (stored < bits) bits = stored;
+    return bits;
+}
+
+/**
+ * Sets the symbol costs in bits from the symbol frequencies using their entropy
+ * @param struct SymbolStats* stats is the stats to update
+*/
+void calculate_costs(struct SymbolStats* stats) {
+    double ll_sum = 0;
+    double d_sum = 0;
+    for (int i = 0; i < 288; i++) ll_sum += stats->ll_freq[i];
+    for (int i = 0; i < 30; i++) d_sum += stats->d_freq[i];
+
+    double ll_log = ll_sum > 0 ? log2(ll_sum) : 0;
+    double d_log = d_sum > 0 ? log2(d_sum) : 0;
+    for (int i = 0; i < 288; i++) {
+        double cost = stats->ll_freq[i] > 0 ? ll_log - log2(stats->ll_freq[i]) : ll_log;
+        stats->ll_cost[i] = cost > 0 ? cost : 0;
+    }
+    for (int i = 0; i < 30; i++) {
+        double cost = stats->d_freq[i] > 0 ? d_log - log2(stats->d_freq[i]) : d_log;
+        stats->d_cost[i] = cost > 0 ? cost : 0;
+    }
+}
+
+/**
+ * Sets the symbol frequencies and costs from a range of tokens
+ * @param struct SymbolStats* stats is the stats to set
+ * @param struct LZ77Token* tokens is the token list
+ * @param size_t start is the first token
+ * @param size_t end is one past the last token
+*/
+void stats_from_tokens(struct SymbolStats* stats, struct LZ77Token* tokens, size_t start, size_t end) {
+    int ll_counts[288];
+    int d_counts[30];
+    count_symbols(tokens, start, end, ll_counts, d_counts);
+    for (int i = 0; i < 288; i++) stats->ll_freq[i] = ll_counts[i];
+    for (int i = 0; i < 30; i++) stats->d_freq[i] = d_counts[i];
+    calculate_costs(stats);
+}
+
+/**
+ * Multiply with carry random number generator.  Deterministic so output is the same every run
+ * @param uint32_t state[2] is the generator state
+ * @return the next random number
+*/
+uint32_t next_random(uint32_t state[2]) {
+    state[1] = 36969 * (state[1] & 65535) + (state[1] >> 16);
+    state[0] = 18000 * (state[0] & 65535) + (state[0] >> 16);
+    return (state[1] << 16) + state[0];
+}
+
+/**
+ * Randomly copies some symbol frequencies over others to shake the optimal parse out of a local minimum
+ * @param struct SymbolStats* stats is the stats to change
+ * @param uint32_t state[2] is the random generator state
+*/
+void randomize_stats(struct SymbolStats* stats, uint32_t state[2]) {
+    for (int i = 0; i < 288; i++) {
+        if ((next_random(state) >> 4) % 3 == 0) stats->ll_freq[i] = stats->ll_freq[next_random(state) % 288];
+    }
+    for (int i = 0; i < 30; i++) {
+        if ((next_random(state) >> 4) % 3 == 0) stats->d_freq[i] = stats->d_freq[next_random(state) % 30];
+    }
+    stats->ll_freq[256] = 1;
+    calculate_costs(stats);
+}
+
+/**
+ * Finds the cheapest parse of [start, end) under the given costs.  Each byte position is a node and every literal
+ * or cached match is an edge so this is a shortest path through the block
+ * @param struct MatchCache* cache is the match cache
+ * @param size_t start is the first byte of the block
+ * @param size_t end is one past the last byte of the block
+ * @param struct SymbolStats* stats holds the cost of each symbol
+ * @param struct TokenList* out is the list the tokens are added to
+*/
+void optimal_parse(struct MatchCache* cache, size_t start, size_t end, struct SymbolStats* stats, struct TokenList* out) {
+    size_t n = end - start;
+    float* costs = malloc((n + 1) * sizeof(float));
+    uint16_t* lens = malloc((n + 1) * sizeof(uint16_t));
+    uint16_t* dists = malloc((n + 1) * sizeof(uint16_t));
+
+    float len_cost[MAX_MATCH + 1];
+    for (int len = MIN_MATCH; len <= MAX_MATCH; len++) {
+        int sym = length_to_sym(len);
+        len_cost[len] = stats->ll_cost[257 + sym] + length_extra[sym];
+    }
+    float dist_cost[30];
+    for (int sym = 0; sym < 30; sym++) {
+        dist_cost[sym] = stats->d_cost[sym] + distance_extra[sym];
+    }
+
+    costs[0] = 0;
+    for (size_t i = 1; i <= n; i++) costs[i] = 1e30f;
+
+    for (size_t i = 0; i < n; i++) {
+        size_t pos = start + i;
+
+        //inside a long run of one byte every step is a max length match at distance 1
+        if (cache->same[pos - cache->start] > MAX_MATCH * 2 && i > MAX_MATCH + 1 && i + MAX_MATCH * 2 <= n
+            && cache->same[pos - MAX_MATCH - cache->start] > MAX_MATCH) {
+            float run_cost = len_cost[MAX_MATCH] + dist_cost[0];
+            for (int k = 0; k < MAX_MATCH; k++) {
+                costs[i + MAX_MATCH] = costs[i] + run_cost;
+                lens[i + MAX_MATCH] = MAX_MATCH;
+                dists[i + MAX_MATCH] = 1;
+                i++;
+            }
+            pos = start + i;
+        }
+
+        float lit = costs[i] + stats->ll_cost[cache->data[pos]];
+        if (lit < costs[i + 1]) {
+            costs[i + 1] = lit;
+            lens[i + 1] = 1;
+            dists[i + 1] = 0;
+        }
+
+        int count = cache->match_count[pos - cache->start];
+        struct LZ77Token* matches = cache->matches + (pos - cache->start) * MATCH_CACHE_LEN;
+        int prev_len = MIN_MATCH - 1;
+        int left = n - i < MAX_MATCH ? (int) (n - i) : MAX_MATCH; //no match runs past the end of the block
+        for (int m = 0; m < count && prev_len < left; m++) {
+            int max_len = matches[m].litlen;
+            if (max_len > left) max_len = left;
+            float base = costs[i] + dist_cost[distance_to_sym(matches[m].dist)];
+            for (int len = prev_len + 1; len <= max_len; len++) {
+                float cost = base + len_cost[len];
+                if (cost < costs[i + len]) {
+                    costs[i + len] = cost;
+                    lens[i + len] = len;
+                    dists[i + len] = matches[m].dist;
+                }
+            }
+            if (max_len > prev_len) prev_len = max_len;
+        }
+    }
+
+    //walk the path back from the end then add the tokens in order
+    size_t num_steps = 0;
+    for (size_t i = n; i > 0; i -= lens[i]) num_steps++;
+    for (size_t k = 0; k < num_steps; k++) add_token(out, 0, 0);
+    size_t k = out->count;
+    for (size_t i = n; i > 0; i -= lens[i]) {
+        k--;
+        if (lens[i] == 1) {
+            out->tokens[k].litlen = cache->data[start + i - 1];
+            out->tokens[k].dist = 0;
+        } else {
+            out->tokens[k].litlen = lens[i];
+            out->tokens[k].dist = dists[i];
+        }
+    }
+
+    free(costs);
+    free(lens);
+    free(dists);
+}
+
+/**
+ * Repeats the optimal parse of [start, end), re-estimating symbol costs from the previous parse each time, and keeps
+ * the parse with the smallest block
+ * @param struct MatchCache* cache is the match cache
+ * @param size_t start is the first byte of the block
+ * @param size_t end is one past the last byte of the block
+ * @param int iterations is the number of parses to try
+ * @param struct TokenList* out is the list the best tokens are added to
+*/
+void optimize_block(struct MatchCache* cache, size_t start, size_t end, int iterations, struct TokenList* out) {
+    struct TokenList best = {0};
+    lazy_parse(cache, start, end, &best);
+    size_t best_bits = block_bits(best.tokens, 0, best.count, end - start);
+
+    struct SymbolStats stats;
+    struct SymbolStats last_stats;
+    stats_from_tokens(&stats, best.tokens, 0, best.count);
+    struct SymbolStats best_stats = stats;
+
+    uint32_t random_state[2] = {1, 2};
+    int randomized = 0;
+    size_t last_bits = 0;
+    struct TokenList cur = {0};
+    for (int i = 0; i < iterations; i++) {
+        cur.count = 0;
+        optimal_parse(cache, start, end, &stats, &cur);
+        size_t bits = block_bits(cur.tokens, 0, cur.count, end - start);
+
+        struct TokenList* parsed = &cur;
+        if (bits < best_bits) {
+            struct TokenList tmp = best;
+            best = cur;
+            cur = tmp;
+            parsed = &best;
+            best_bits = bits;
+            best_stats = stats;
+        }
+
+        last_stats = stats;
+        stats_from_tokens(&stats, parsed->tokens, 0, parsed->count);
+
+        //once randomness has kicked in blend with the last stats so it converges slower but better
+        if (randomized) {
+            for (int s = 0; s < 288; s++) stats.ll_freq[s] += last_stats.ll_freq[s] * 0.5;
+            for (int s = 0; s < 30; s++) stats.d_freq[s] += last_stats.d_freq[s] * 0.5;
+            calculate_costs(&stats);
+        }
+        if (i > 5 && bits == last_bits) {
+            stats = best_stats;
+            randomize_stats(&stats, random_state);
+            randomized = 1;
+        }
+        last_bits = bits;
+    }
+
+    for (size_t i = 0; i < best.count; i++) add_token(out, best.tokens[i].litlen, best.tokens[i].dist);
+    free(best.tokens);
+    free(cur.tokens);
+}
+
+/**
+ * Returns the size in bits of a range of tokens as one block
+ * @param struct LZ77Token* tokens is the token list
+ * @param size_t* byte_pos is the number of bytes before each token
+ * @param size_t start is the first token
+ * @param size_t end is one past the last token
+ * @return the block size in bits
+*/
+size_t range_bits(struct LZ77Token* tokens, size_t* byte_pos, size_t start, size_t end) {
+    return block_bits(tokens, start, end, byte_pos[end] - byte_pos[start]);
+}
+
+/**
+ * Finds the token to split [start, end) at so the two blocks are smallest.  Small ranges are searched fully,
+ * large ones by repeatedly sampling SPLIT_SAMPLES points and narrowing around the best
+ * @param struct LZ77Token* tokens is the token list
+ * @param size_t* byte_pos is the number of bytes before each token
+ * @param size_t start is the first token
+ * @param size_t end is one past the last token
+ * @param size_t* best_bits is set to the size in bits of both blocks
+ * @return the first token of the second block
+*/
+size_t find_split(struct LZ77Token* tokens, size_t* byte_pos, size_t start, size_t end, size_t* best_bits) {
+    size_t lo = start + 1;
+    size_t hi = end;
+    size_t best = lo;
+    *best_bits = (size_t) -1;
+
+    if (hi - lo < 1024) {
+        for (size_t i = lo; i < hi; i++) {
+            size_t bits = range_bits(tokens, byte_pos, start, i) + range_bits(tokens, byte_pos, i, end);
+            if (bits < *best_bits) {
+                *best_bits = bits;
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    size_t points[SPLIT_SAMPLES];
+    size_t point_bits[SPLIT_SAMPLES];
+    while (hi - lo > SPLIT_SAMPLES) {
+        int best_i = 0;
+        for (int i = 0; i < SPLIT_SAMPLES; i++) {
+            points[i] = lo + (i + 1) * ((hi - lo) / (SPLIT_SAMPLES + 1));
+            point_bits[i] = range_bits(tokens, byte_pos, start, points[i]) + range_bits(tokens, byte_pos, points[i], end);
+            if (point_bits[i] < point_bits[best_i]) best_i = i;
+        }
+        if (point_bits[best_i] > *best_bits) break;
+
+        lo = best_i == 0 ? lo : points[best_i - 1];
+        hi = best_i == SPLIT_SAMPLES - 1 ? hi : points[best_i + 1];
+        best = points[best_i];
+        *best_bits = point_bits[best_i];
+    }
+    return best;
+}
+
+/**
+ * Splits a token list into blocks wherever giving each part its own prefix codes makes the output smaller.
+ * The largest unsplit block is split next until no split helps or there are max_blocks blocks
+ * @param struct LZ77Token* tokens is the token list
+ * @param size_t count is the number of tokens
+ * @param size_t* byte_pos is the number of bytes before each token
+ * @param int max_blocks is the most blocks to make
+ * @param size_t* splits is set to the first token of every block but the first in order.  Must hold max_blocks
+ * @return the number of splits
+*/
+int split_tokens(struct LZ77Token* tokens, size_t count, size_t* byte_pos, int max_blocks, size_t* splits) {
+    int num_splits = 0;
+    if (count < 10) return 0;
+
+    uint8_t* done = calloc(count + 1, 1);
+    size_t start = 0;
+    size_t end = count;
+    while (num_splits + 1 < max_blocks) {
+        size_t split_bits;
+        size_t split = find_split(tokens, byte_pos, start, end, &split_bits);
+        size_t whole_bits = range_bits(tokens, byte_pos, start, end);
+
+        if (split_bits > whole_bits || split == start + 1 || split == end) {
+            done[start] = 1;
+        } else {
+            int i = num_splits++;
+            while (i > 0 && splits[i - 1] > split) {
+                splits[i] = splits[i - 1];
+                i--;
+            }
+            splits[i] = split;
+        }
+
+        //next try the largest block not already done
+        size_t longest = 0;
+        for (int i = 0; i <= num_splits; i++) {
+            size_t s = i == 0 ? 0 : splits[i - 1];
+            size_t e = i == num_splits ? count : splits[i];
+            if (!done[s] && e - s > longest) {
+                start = s;
+                end = e;
+                longest = e - s;
+            }
+        }
+        if (longest < 10) break;
+    }
+
+    free(done);
+    return num_splits;
+}
+
+/**
+ * Writes aligned bytes to the stream
+ * @param struct BitWriter* bw is the output stream.  Must be on a byte boundary
+ * @param uint8_t* data is the bytes to write
+ * @param size_t len is the number of bytes to write
+*/
+void write_bytes(struct BitWriter* bw, uint8_t* data, size_t len) {
+    if (bw->len + len > bw->cap) {
+        bw->cap = (bw->len + len) * 2;
+        bw->data = realloc(bw->data, bw->cap);
+    }
+    memcpy(bw->data + bw->len, data, len);
+    bw->len += len;
+}
+
+/**
+ * Writes the tokens of a type 1 or type 2 block followed by the end of block code
+ * @param struct BitWriter* bw is the output stream
+ * @param struct LZ77Token* tokens is the token list
+ * @param size_t start is the first token
+ * @param size_t end is one past the last token
+ * @param struct CodeLength* LL_tree is the LL encode table
+ * @param struct CodeLength* distance_tree is the distance encode table
+*/
+void write_tokens(struct BitWriter* bw, struct LZ77Token* tokens, size_t start, size_t end, struct CodeLength* LL_tree, struct CodeLength* distance_tree) {
+    for (size_t i = start; i < end; i++) {
+        if (!tokens[i].dist) {
+            write_code(bw, LL_tree[tokens[i].litlen]);
+            continue;
+        }
+        int len_sym = length_to_sym(tokens[i].litlen);
+        write_code(bw, LL_tree[257 + len_sym]);
+        write_bits(bw, tokens[i].litlen - length_base[len_sym], length_extra[len_sym]);
+
+        int dist_sym = distance_to_sym(tokens[i].dist);
+        write_code(bw, distance_tree[dist_sym]);
+        write_bits(bw, tokens[i].dist - distance_base[dist_sym], distance_extra[dist_sym]);
+    }
+    write_code(bw, LL_tree[256]);
+}
+
+/**
+ * Writes a range of tokens as whichever block type is smallest
+ * @param struct BitWriter* bw is the output stream
+ * @param uint8_t* data is the uncompressed input
+ * @param struct LZ77Token* tokens is the token list
+ * @param size_t* byte_pos is the number of bytes before each token
+ * @param size_t start is the first token
+ * @param size_t end is one past the last token
+ * @param int final is true if this is the last block of the stream
+*/
+void write_block(struct BitWriter* bw, uint8_t* data, struct LZ77Token* tokens, size_t* byte_pos, size_t start, size_t end, int final) {
+    int ll_counts[288];
+    int d_counts[30];
+    count_symbols(tokens, start, end, ll_counts, d_counts);
+
+    size_t dynamic = dynamic_block_bits(ll_counts, d_counts);
+    size_t fixed = fixed_block_bits(ll_counts, d_counts);
+    size_t stored = stored_block_bits(byte_pos[end] - byte_pos[start]);
+
+    if (stored < dynamic && stored < fixed) {
+        size_t pos = byte_pos[start];
+        do {
+            size_t len = byte_pos[end] - pos < BLOCK_ZERO_MAX ? byte_pos[end] - pos : BLOCK_ZERO_MAX;
+            write_bits(bw, final && pos + len == byte_pos[end], 1);
+            write_bits(bw, 0, 2);
+            bw->bit = 0; //skip to the next byte boundary
+            write_bits(bw, len, 16);
+            write_bits(bw, ~len & 0xffff, 16);
+            write_bytes(bw, data + pos, len);
+            pos += len;
+        } while (pos < byte_pos[end]);
+        return;
+    }
+
+    struct CodeLength LL_tree[288] = {{0}};
+    struct CodeLength distance_tree[32] = {{0}};
+    write_bits(bw, final, 1);
+    if (fixed <= dynamic) {
+        write_bits(bw, 1, 2);
+        make_BT_ONE_LL_code(LL_tree);
+        make_BT_ONE_distance_code(distance_tree);
+    } else {
+        int ll_lengths[288];
+        int d_lengths[30];
+        dynamic_lengths(ll_counts, d_counts, ll_lengths, d_lengths);
+        generate_codes_from_bl(ll_lengths, 288, LL_tree);
+        generate_codes_from_bl(d_lengths, 30, distance_tree);
+
+        write_bits(bw, 2, 2);
+        tree_header(ll_lengths, d_lengths, bw);
+    }
+    write_tokens(bw, tokens, start, end, LL_tree, distance_tree);
+}
+
+/**
+ * Job for run_jobs that optimizes one block of a master block
+ * @param void* ctx is the struct BlockJobs*
+ * @param int index is the block to optimize
+*/
+void optimize_block_job(void* ctx, int index) {
+    struct BlockJobs* jobs = ctx;
+    optimize_block(jobs->cache, jobs->bounds[index], jobs->bounds[index + 1], jobs->iterations, &jobs->lists[index]);
+}
+
+/**
+ * Returns the number of bytes before each token
+ * @param struct LZ77Token* tokens is the token list
+ * @param size_t count is the number of tokens
+ * @return the MALLOCED list of count + 1 byte positions
+*/
+size_t* token_byte_pos(struct LZ77Token* tokens, size_t count) {
+    size_t* byte_pos = malloc((count + 1) * sizeof(size_t));
+    byte_pos[0] = 0;
+    for (size_t i = 0; i < count; i++) {
+        byte_pos[i + 1] = byte_pos[i] + (tokens[i].dist ? tokens[i].litlen : 1);
+    }
+    return byte_pos;
+}
+
+/**
+ * Compresses [start, end) of the input: split a quick parse into blocks, optimize every block in parallel,
+ * then split the optimized tokens again if that beats the first split
+ * @param struct BitWriter* bw is the output stream
+ * @param uint8_t* data is the whole input
+ * @param size_t data_len is the length of the whole input
+ * @param size_t start is the first byte of the master block
+ * @param size_t end is one past the last byte of the master block
+ * @param int final is true if this is the last master block
+ * @param int iterations is the number of optimal parses to try per block
+ * @param int threads is the number of threads to use
+*/
+void compress_master_block(struct BitWriter* bw, uint8_t* data, size_t data_len, size_t start, size_t end, int final, int iterations, int threads) {
+    struct MatchCache cache;
+    build_match_cache(&cache, data, data_len, start, end, threads);
+
+    //first split on a quick parse
+    struct TokenList quick = {0};
+    lazy_parse(&cache, start, end, &quick);
+    size_t* byte_pos = token_byte_pos(quick.tokens, quick.count);
+    size_t splits[MAX_SPLIT_BLOCKS];
+    int num_splits = split_tokens(quick.tokens, quick.count, byte_pos, MAX_SPLIT_BLOCKS, splits);
+
+    struct BlockJobs jobs;
+    jobs.cache = &cache;
+    jobs.iterations = iterations;
+    jobs.bounds[0] = start;
+    for (int i = 0; i < num_splits; i++) jobs.bounds[i + 1] = start + byte_pos[splits[i]];
+    jobs.bounds[num_splits + 1] = end;
+    jobs.lists = calloc(num_splits + 1, sizeof(struct TokenList));
+    free(byte_pos);
+    free(quick.tokens);
+
+    run_jobs(threads, num_splits + 1, optimize_block_job, &jobs);
+
+    //join the blocks, remembering where the first split put them
+    struct TokenList all = {0};
+    size_t first_splits[MAX_SPLIT_BLOCKS];
+    for (int i = 0; i <= num_splits; i++) {
+        if (i > 0) first_splits[i - 1] = all.count;
+        for (size_t k = 0; k < jobs.lists[i].count; k++) {
+            add_token(&all, jobs.lists[i].tokens[k].litlen, jobs.lists[i].tokens[k].dist);
+        }
+        free(jobs.lists[i].tokens);
+    }
+    free(jobs.lists);
+    free_match_cache(&cache);
+
+    byte_pos = token_byte_pos(all.tokens, all.count);
+    size_t last_splits[MAX_SPLIT_BLOCKS];
+    int num_last_splits = split_tokens(all.tokens, all.count, byte_pos, MAX_SPLIT_BLOCKS, last_splits);
+
+    size_t first_bits = 0;
+    size_t last_bits = 0;
+    for (int i = 0; i <= num_splits; i++) {
+        first_bits += range_bits(all.tokens, byte_pos, i == 0 ? 0 : first_splits[i - 1], i == num_splits ? all.count : first_splits[i]);
+    }
+    for (int i = 0; i <= num_last_splits; i++) {
+        last_bits += range_bits(all.tokens, byte_pos, i == 0 ? 0 : last_splits[i - 1], i == num_last_splits ? all.count : last_splits[i]);
+    }
+    if (last_bits < first_bits) {
+        num_splits = num_last_splits;
+        memcpy(first_splits, last_splits, sizeof(last_splits));
+    }
+
+    //byte_pos is relative to start but write_block wants positions in the whole input
+    for (size_t i = 0; i <= all.count; i++) byte_pos[i] += start;
+    for (int i = 0; i <= num_splits; i++) {
+        size_t block_start = i == 0 ? 0 : first_splits[i - 1];
+        size_t block_end = i == num_splits ? all.count : first_splits[i];
+        write_block(bw, data, all.tokens, byte_pos, block_start, block_end, final && i == num_splits);
+    }
+
+    free(byte_pos);
+    free(all.tokens);
+}
+
+/**
+ * Compresses data as a raw Deflate stream with maximum effort.  Much slower than a normal encoder but the output is
+ * still standard Deflate
+ * @param struct BitWriter* bw is the output stream
+ * @param uint8_t* data is the bytes to compress
+ * @param size_t len is the number of bytes to compress
+ * @param int iterations is the number of optimal parses to try per block.  15 is a good default
+ * @param int threads is the number of threads to use
+*/
+void deflate_max(struct BitWriter* bw, uint8_t* data, size_t len, int iterations, int threads) {
+    if (len == 0) { //a single empty block of type 1
+        write_bits(bw, 1, 1);
+        write_bits(bw, 1, 2);
+        write_bits(bw, 0, 7);
+        return;
+    }
+
+    for (size_t start = 0; start < len; start += MASTER_BLOCK_SIZE) {
+        size_t end = len - start > MASTER_BLOCK_SIZE ? start + MASTER_BLOCK_SIZE : len;
+        compress_master_block(bw, data, len, start, end, end == len, iterations, threads);
+    }
+}
+
+/**
+ * Compresses data as a zlib stream (RFC 1950) with maximum effort, as needed for PNG IDAT chunks
+ * @param uint8_t* data is the bytes to compress
+ * @param size_t len is the number of bytes to compress
+ * @param size_t* out_len is set to the length of the compressed stream
+ * @param int iterations is the number of optimal parses to try per block.  15 is a good default
+ * @param int threads is the number of threads to use
+ * @return the MALLOCED compressed stream
+*/
+uint8_t* zlib_compress_max(uint8_t* data, size_t len, size_t* out_len, int iterations, int threads) {
+    init_cpu_dispatch();
+    struct BitWriter bw = {0};
+    write_bits(&bw, 0x78, 8); //deflate with a 32K window
+    write_bits(&bw, 0xda, 8); //maximum compression, no dictionary, check bits
+
+    deflate_max(&bw, data, len, iterations, threads);
+
+    uint32_t adler = adler32_update(1, data, len);
+    bw.bit = 0;
+    for (int i = 3; i >= 0; i--) {
+        write_bits(&bw, (adler >> (8 * i)) & 0xff, 8);
+    }
+
+    *out_len = bw.len;
+    return bw.data;
+}
@@ -1,4 +1,80 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#define BLOCK_ZERO_MAX 65535
+
+#define WINDOW_SIZE 32768
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define HASH_BITS 16
+#define HASH_SIZE (1 << HASH_BITS)
+#define MAX_CHAIN 8192              //most hash chain links followed per position
+#define MATCH_CACHE_LEN 8           //most matches cached per position
+#define MATCH_JOB_SIZE 65536        //positions searched per thread job
+#define MASTER_BLOCK_SIZE 1000000   //input is compressed this many bytes at a time to bound memory
+#define MAX_SPLIT_BLOCKS 15         //most blocks a master block is split into
+#define SPLIT_SAMPLES 9             //points sampled per step when searching for a block split
+
+//Writes bits least significant bit first as Deflate expects (3.1.1)
+struct BitWriter {
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+    uint8_t bit;    //next bit to write within the last byte.  0 means a new byte is needed
+};
+
+//A literal (dist of 0) or a <length, distance> pair
+struct LZ77Token {
+    uint16_t litlen;
+    uint16_t dist;
+};
+
+struct TokenList {
+    struct LZ77Token* tokens;
+    size_t count;
+    size_t cap;
+};
+
+//Matches for every position of a master block.  Each position holds the closest distance for increasing lengths
+struct MatchCache {
+    uint8_t* data;
+    size_t start;
+    size_t end;
+    size_t region_start;            //first position in the hash chains.  Up to WINDOW_SIZE before start
+    int* prev;                      //previous position relative to region_start with the same hash or -1
+    struct LZ77Token* matches;      //MATCH_CACHE_LEN per position by ascending length
+    uint8_t* match_count;
+    uint16_t* same;                 //length of the run of identical bytes starting at each position
+};
+
+//Symbol frequencies and their estimated cost in bits for the optimal parse
+struct SymbolStats {
+    double ll_freq[288];
+    double d_freq[30];
+    float ll_cost[288];
+    float d_cost[30];
+};
+
+//Blocks of a master block optimized by run_jobs
+struct BlockJobs {
+    struct MatchCache* cache;
+    size_t bounds[MAX_SPLIT_BLOCKS + 1];
+    struct TokenList* lists;
+    int iterations;
+};
+
+extern int length_base[29];
+extern int length_extra[29];
+extern int distance_base[30];
+extern int distance_extra[30];
+extern int code_length_order[19];
 
 void make_BT_ONE_LL_code(struct CodeLength tree[288]);
 
-void make_BT_ONE_distance_code(struct CodeLength tree[32]);
\ No newline at end of file
+void make_BT_ONE_distance_code(struct CodeLength tree[32]);
+
+void write_bits(struct BitWriter* bw, uint32_t value, int num_bits);
+
+void deflate_max(struct BitWriter* bw, uint8_t* data, size_t len, int iterations, int threads);
+
+uint8_t* zlib_compress_max(uint8_t* data, size_t len, size_t* out_len, int iterations, int threads);
@@ -0,0 +1,420 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "filter.h"
+#include "cpu.h"
+
+/**
+ * Picks whichever of left, up or upper left is closest to left + up - upper left
+ * As defined here: https://www.w3.org/TR/png/#9Filter-type-4-Paeth
+ * @param int a is the byte to the left
+ * @param int b is the byte above
+ * @param int c is the byte to the upper left
+ * @return the predicted byte
+*/
+uint8_t paeth_predictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+/**
+ * Filters a single scanline with the given filter type.  Does NOT write the filter type byte
+ * @param uint8_t filter_type is the filter to use (FILTER_NONE to FILTER_PAETH)
+ * @param uint8_t* row is the unfiltered scanline
+ * @param uint8_t* prev is the unfiltered scanline above.  All zeros for the first row
+ * @param uint8_t* out is where the filtered bytes are written
+ * @param int row_len is the number of bytes in the scanline
+ * @param int bpp is the bytes per complete pixel rounded up to 1
+*/
+void filter_row(uint8_t filter_type, uint8_t* row, uint8_t* prev, uint8_t* out, int row_len, int bpp) {
+    for (int i = 0; i < row_len; i++) {
+        int a = i >= bpp ? row[i - bpp] : 0;
+        int b = prev[i];
+        int c = i >= bpp ? prev[i - bpp] : 0;
+        uint8_t predict = 0;
+
+        if (filter_type == FILTER_SUB) {
+            predict = a;
+        } else if (filter_type == FILTER_UP) {
+            predict = b;
+        } else if (filter_type == FILTER_AVERAGE) {
+            predict = (a + b) >> 1;
+        } else if (filter_type == FILTER_PAETH) {
+            predict = paeth_predictor(a, b, c);
+        }
+        out[i] = row[i] - predict;
+    }
+}
+
+//Points at the fastest version init_cpu_dispatch finds for this CPU
+int (*unfilter_row)(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp) = unfilter_row_scalar;
+
+/**
+ * Reverses the filter on a single scanline in place one byte at a time
+ * @param uint8_t filter_type is the filter type byte read before the scanline
+ * @param uint8_t* row is the filtered scanline which becomes the unfiltered scanline
+ * @param uint8_t* prev is the unfiltered scanline above.  All zeros for the first row
+ * @param int row_len is the number of bytes in the scanline
+ * @param int bpp is the bytes per complete pixel rounded up to 1
+ * @return -1 if the filter type is invalid 0 otherwise
+*/
+int unfilter_row_scalar(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp) {
+    if (filter_type > FILTER_PAETH) {
+        return -1;
+    }
+
+    for (int i = 0; i < row_len; i++) {
+        int a = i >= bpp ? row[i - bpp] : 0;
+        int b = prev[i];
+        int c = i >= bpp ? prev[i - bpp] : 0;
+
+        if (filter_type == FILTER_SUB) {
+            row[i] += a;
+        } else if (filter_type == FILTER_UP) {
+            row[i] += b;
+        } else if (filter_type == FILTER_AVERAGE) {
+            row[i] += (a + b) >> 1;
+        } else if (filter_type == FILTER_PAETH) {
+            row[i] += paeth_predictor(a, b, c);
+        }
+    }
+    return 0;
+}
+
+//unfilter_row_scalar for one bpp.  The filter type is looked at once per scanline instead of once per byte and
+//BPP is known at compile time so the left and upper left bytes are fixed offsets with no check for the first pixel
+#define DEFINE_UNFILTER_ROW(BPP) \
+int unfilter_row_bpp##BPP(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp) { \
+    (void) bpp; \
+    int first = row_len < BPP ? row_len : BPP; \
+    if (filter_type == FILTER_NONE) { \
+        return 0; \
+    } else if (filter_type == FILTER_SUB) { \
+        for (int i = BPP; i < row_len; i++) row[i] += row[i - BPP]; \
+    } else if (filter_type == FILTER_UP) { \
+        for (int i = 0; i < row_len; i++) row[i] += prev[i]; \
+    } else if (filter_type == FILTER_AVERAGE) { \
+        for (int i = 0; i < first; i++) row[i] += prev[i] >> 1; \
+        for (int i = BPP; i < row_len; i++) row[i] += (row[i - BPP] + prev[i]) >> 1; \
+    } else if (filter_type == FILTER_PAETH) { \
+        /*with no pixel to the left Paeth always picks the byte above*/ \
+        for (int i = 0; i < first; i++) row[i] += prev[i]; \
+        for (int i = BPP; i < row_len; i++) { \
+            /*paeth_predictor written so the picks compile to conditional moves instead of branches*/ \
+            int a = row[i - BPP]; \
+            int b = prev[i]; \
+            int c = prev[i - BPP]; \
+            int pa = abs(b - c); \
+            int pb = abs(a - c); \
+            int pc = abs(a + b - 2 * c); \
+            int pick = pb <= pc ? b : c; \
+            row[i] += pa <= pb && pa <= pc ? a : pick; \
+        } \
+    } else { \
+        return -1; \
+    } \
+    return 0; \
+}
+
+DEFINE_UNFILTER_ROW(1)
+DEFINE_UNFILTER_ROW(2)
+DEFINE_UNFILTER_ROW(3)
+DEFINE_UNFILTER_ROW(4)
+DEFINE_UNFILTER_ROW(6)
+DEFINE_UNFILTER_ROW(8)
+
+#if defined(__x86_64__) || defined(__i386__)
+//Pixels of 3, 4, 6 or 8 bytes moved as one 64 bit value.  3 and 6 byte pixels are built from smaller pieces so they
+//never read past themselves or read back a partly written value
+#define LOAD_PIXEL(dest, p, BPP) do { \
+    if (BPP == 3) { \
+        (dest) = (p)[0] | (p)[1] << 8 | (p)[2] << 16; \
+    } else if (BPP == 6) { \
+        uint32_t low; \
+        memcpy(&low, p, 4); \
+        (dest) = low | (uint64_t) ((p)[4] | (p)[5] << 8) << 32; \
+    } else { \
+        (dest) = 0; \
+        memcpy(&(dest), p, BPP); \
+    } \
+} while (0)
+#define STORE_PIXEL(p, v, BPP) do { \
+    if (BPP == 3) { \
+        (p)[0] = (v); \
+        (p)[1] = (v) >> 8; \
+        (p)[2] = (v) >> 16; \
+    } else if (BPP == 6) { \
+        uint32_t low = (v); \
+        memcpy(p, &low, 4); \
+        (p)[4] = (v) >> 32; \
+        (p)[5] = (v) >> 40; \
+    } else { \
+        memcpy(p, &(v), BPP); \
+    } \
+} while (0)
+
+//Reverses Sub, Average or Paeth one whole BPP byte pixel at a time, since each pixel depends on the one to its
+//left.  BPP is known at compile time so the pixel loads and stores fold into single moves
+#define DEFINE_UNFILTER_PIXELS(BPP) \
+__attribute__((target("sse2"))) \
+void unfilter_pixels_##BPP(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len) { \
+    __m128i zero = _mm_setzero_si128(); \
+    __m128i a = zero; /*pixel to the left*/ \
+    __m128i c = zero; /*pixel to the upper left*/ \
+    for (int i = 0; i + BPP <= row_len; i += BPP) { \
+        uint64_t v; \
+        LOAD_PIXEL(v, prev + i, BPP); \
+        __m128i b = _mm_loadl_epi64((__m128i*) &v); \
+        LOAD_PIXEL(v, row + i, BPP); \
+        __m128i x = _mm_loadl_epi64((__m128i*) &v); \
+        if (filter_type == FILTER_SUB) { \
+            x = _mm_add_epi8(x, a); \
+        } else if (filter_type == FILTER_AVERAGE) { \
+            /*_mm_avg_epu8 rounds up so take off the low bit when a + b is odd*/ \
+            __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1))); \
+            x = _mm_add_epi8(x, avg); \
+        } else { \
+            /*Paeth in 16 bits.  p - a = b - c, p - b = a - c and p - c is the sum of the two*/ \
+            __m128i a16 = _mm_unpacklo_epi8(a, zero); \
+            __m128i b16 = _mm_unpacklo_epi8(b, zero); \
+            __m128i c16 = _mm_unpacklo_epi8(c, zero); \
+            __m128i pa = _mm_sub_epi16(b16, c16); \
+            __m128i pb = _mm_sub_epi16(a16, c16); \
+            __m128i pc = _mm_add_epi16(pa, pb); \
+            pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa)); \
+            pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb)); \
+            pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc)); \
+            /*ties go to a, then b, then c*/ \
+            __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb)); \
+            __m128i use_a = _mm_cmpeq_epi16(smallest, pa); \
+            __m128i use_b = _mm_cmpeq_epi16(smallest, pb); \
+            __m128i pick = _mm_or_si128(_mm_and_si128(use_b, b16), _mm_andnot_si128(use_b, c16)); \
+            pick = _mm_or_si128(_mm_and_si128(use_a, a16), _mm_andnot_si128(use_a, pick)); \
+            x = _mm_add_epi8(x, _mm_packus_epi16(pick, pick)); \
+        } \
+        _mm_storel_epi64((__m128i*) &v, x); \
+        STORE_PIXEL(row + i, v, BPP); \
+        a = x; \
+        c = b; \
+    } \
+}
+
+DEFINE_UNFILTER_PIXELS(3)
+DEFINE_UNFILTER_PIXELS(4)
+DEFINE_UNFILTER_PIXELS(6)
+DEFINE_UNFILTER_PIXELS(8)
+
+//Adds the scanline above 16 bytes at a time
+__attribute__((target("sse2")))
+void unfilter_up_sse2(uint8_t* row, uint8_t* prev, int row_len) {
+    int i = 0;
+    for (; i + 16 <= row_len; i += 16) {
+        __m128i sum = _mm_add_epi8(_mm_loadu_si128((__m128i*) (row + i)), _mm_loadu_si128((__m128i*) (prev + i)));
+        _mm_storeu_si128((__m128i*) (row + i), sum);
+    }
+    for (; i < row_len; i++) row[i] += prev[i];
+}
+
+/**
+ * Reverses the filter on a single scanline in place with SSE2.  Up works 16 bytes at a time for any bpp.  Sub,
+ * Average and Paeth are done a pixel at a time for the common 3 and 4 byte pixels and by unfilter_row_scalar
+ * for the rest
+ * @param uint8_t filter_type is the filter type byte read before the scanline
+ * @param uint8_t* row is the filtered scanline which becomes the unfiltered scanline
+ * @param uint8_t* prev is the unfiltered scanline above.  All zeros for the first row
+ * @param int row_len is the number of bytes in the scanline
+ * @param int bpp is the bytes per complete pixel rounded up to 1
+ * @return -1 if the filter type is invalid 0 otherwise
+*/
+__attribute__((target("sse2")))
+int unfilter_row_sse2(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp) {
+    if (filter_type > FILTER_PAETH) return -1;
+    if (filter_type == FILTER_NONE) return 0;
+
+    if (filter_type == FILTER_UP) {
+        unfilter_up_sse2(row, prev, row_len);
+    } else if (bpp == 3) {
+        unfilter_pixels_3(filter_type, row, prev, row_len);
+    } else if (bpp == 4) {
+        unfilter_pixels_4(filter_type, row, prev, row_len);
+    } else {
+        return unfilter_row_scalar(filter_type, row, prev, row_len, bpp);
+    }
+    return 0;
+}
+
+//unfilter_row_sse2 for one bpp.  Up is SSE2 for every bpp.  Sub, Average and Paeth use LEFT, whichever of the SSE2
+//pixel at a time kernel and the scalar unfilter_row_bpp kernel is faster on that pixel size.  1 and 2 byte pixels
+//have too little in each pixel for SSE2 to pay off, and 3 byte pixels lose on Sub
+#define DEFINE_UNFILTER_ROW_SSE2(BPP, LEFT) \
+__attribute__((target("sse2"))) \
+int unfilter_row_bpp##BPP##_sse2(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp) { \
+    (void) bpp; \
+    if (filter_type > FILTER_PAETH) return -1; \
+    if (filter_type == FILTER_NONE) return 0; \
+    if (filter_type == FILTER_UP) { \
+        unfilter_up_sse2(row, prev, row_len); \
+        return 0; \
+    } \
+    return LEFT; \
+}
+
+DEFINE_UNFILTER_ROW_SSE2(1, unfilter_row_bpp1(filter_type, row, prev, row_len, bpp))
+DEFINE_UNFILTER_ROW_SSE2(2, unfilter_row_bpp2(filter_type, row, prev, row_len, bpp))
+DEFINE_UNFILTER_ROW_SSE2(3, filter_type == FILTER_SUB ? unfilter_row_bpp3(filter_type, row, prev, row_len, bpp)
+                                                       : (unfilter_pixels_3(filter_type, row, prev, row_len), 0))
+DEFINE_UNFILTER_ROW_SSE2(4, (unfilter_pixels_4(filter_type, row, prev, row_len), 0))
+DEFINE_UNFILTER_ROW_SSE2(6, (unfilter_pixels_6(filter_type, row, prev, row_len), 0))
+DEFINE_UNFILTER_ROW_SSE2(8, (unfilter_pixels_8(filter_type, row, prev, row_len), 0))
+#endif
+
+/**
+ * Picks the unfilter kernel for an image's pixel size so the bpp is fixed at compile time instead of looked at for
+ * every byte.  Call once per image after reading IHDR
+ * @param uint8_t color_type is the IHDR color type
+ * @param uint8_t bit_depth is the IHDR bit depth
+ * @return a function with the same arguments as unfilter_row.  It ignores its bpp argument
+*/
+int (*row_unfilterer(uint8_t color_type, uint8_t bit_depth))(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp) {
+    init_cpu_dispatch();
+    int bits = bits_per_pixel(color_type, bit_depth);
+    int bpp = bits >= 8 ? bits / 8 : 1;
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu_features.sse2) {
+        switch (bpp) {
+            case 1: return unfilter_row_bpp1_sse2;
+            case 2: return unfilter_row_bpp2_sse2;
+            case 3: return unfilter_row_bpp3_sse2;
+            case 4: return unfilter_row_bpp4_sse2;
+            case 6: return unfilter_row_bpp6_sse2;
+            case 8: return unfilter_row_bpp8_sse2;
+        }
+    }
+#endif
+    switch (bpp) {
+        case 1: return unfilter_row_bpp1;
+        case 2: return unfilter_row_bpp2;
+        case 3: return unfilter_row_bpp3;
+        case 4: return unfilter_row_bpp4;
+        case 6: return unfilter_row_bpp6;
+        case 8: return unfilter_row_bpp8;
+        default: return unfilter_row;
+    }
+}
+
+/**
+ * Returns the number of bits for one pixel
+ * @param uint8_t color_type is the IHDR color type
+ * @param uint8_t bit_depth is the IHDR bit depth
+ * @return bits per pixel or -1 if the combination is not allowed by the spec
+*/
+int bits_per_pixel(uint8_t color_type, uint8_t bit_depth) {
+    int channels;
+    if (color_type == 0) { //greyscale
+        if (bit_depth != 1 && bit_depth != 2 && bit_depth != 4 && bit_depth != 8 && bit_depth != 16) return -1;
+        channels = 1;
+    } else if (color_type == 3) { //indexed
+        if (bit_depth != 1 && bit_depth != 2 && bit_depth != 4 && bit_depth != 8) return -1;
+        channels = 1;
+    } else if (color_type == 2 || color_type == 4 || color_type == 6) { //truecolor, grey alpha, truecolor alpha
+        if (bit_depth != 8 && bit_depth != 16) return -1;
+        channels = color_type == 2 ? 3 : (color_type == 4 ? 2 : 4);
+    } else {
+        return -1;
+    }
+    return channels * bit_depth;
+}
+
+/**
+ * Returns the number of bytes in one scanline not counting the filter type byte
+ * @param int width is the number of pixels in the scanline
+ * @param int bits is the bits per pixel
+ * @return the scanline length in bytes
+*/
+size_t scanline_bytes(int width, int bits) {
+    return ((size_t) width * bits + 7) / 8;
+}
+
+/**
+ * Returns how well a filtered scanline should compress as the sum of its bytes taken as signed distances from 0
+ * @param uint8_t* filtered is the filtered scanline
+ * @param int row_len is the number of bytes in the scanline
+ * @return the sum, lower is better
+*/
+long minsum_score(uint8_t* filtered, int row_len) {
+    long sum = 0;
+    for (int i = 0; i < row_len; i++) {
+        sum += filtered[i] < 128 ? filtered[i] : 256 - filtered[i];
+    }
+    return sum;
+}
+
+/**
+ * Returns how well a filtered scanline should compress as the Shannon entropy of its bytes
+ * @param uint8_t* filtered is the filtered scanline
+ * @param int row_len is the number of bytes in the scanline
+ * @return the entropy in bits of the whole scanline, lower is better
+*/
+double entropy_score(uint8_t* filtered, int row_len) {
+    int counts[256] = {0};
+    for (int i = 0; i < row_len; i++) counts[filtered[i]]++;
+
+    double bits = 0;
+    for (int i = 0; i < 256; i++) {
+        if (counts[i]) bits -= counts[i] * log2((double) counts[i] / row_len);
+    }
+    return bits;
+}
+
+/**
+ * Filters a whole image, choosing each scanline's filter type with the given strategy
+ * @param uint8_t* pixels is the unfiltered scanlines one after another
+ * @param int height is the number of scanlines
+ * @param int row_len is the number of bytes in each scanline
+ * @param int bpp is the bytes per complete pixel rounded up to 1
+ * @param int strategy is a filter type to use on every scanline, FILTER_STRATEGY_MINSUM or FILTER_STRATEGY_ENTROPY
+ * @return the MALLOCED filtered image with the filter type byte before every scanline
+*/
+uint8_t* filter_image(uint8_t* pixels, int height, int row_len, int bpp, int strategy) {
+    uint8_t* out = malloc((size_t) height * (row_len + 1));
+    uint8_t* zeros = calloc(row_len, 1);
+    uint8_t* trial = malloc(row_len);
+
+    for (int y = 0; y < height; y++) {
+        uint8_t* row = pixels + (size_t) y * row_len;
+        uint8_t* prev = y ? row - row_len : zeros;
+        uint8_t* dest = out + (size_t) y * (row_len + 1);
+
+        if (strategy <= FILTER_PAETH) {
+            dest[0] = strategy;
+            filter_row(strategy, row, prev, dest + 1, row_len, bpp);
+            continue;
+        }
+
+        //try every filter type on this scanline and keep the best scoring
+        double best_score = 0;
+        for (uint8_t type = FILTER_NONE; type <= FILTER_PAETH; type++) {
+            filter_row(type, row, prev, trial, row_len, bpp);
+            double score = strategy == FILTER_STRATEGY_MINSUM ? minsum_score(trial, row_len) : entropy_score(trial, row_len);
+            if (type == FILTER_NONE || score < best_score) {
+                best_score = score;
+                dest[0] = type;
+                memcpy(dest + 1, trial, row_len);
+            }
+        }
+    }
+
+    free(zeros);
+    free(trial);
+    return out;
+}
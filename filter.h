@@ -0,0 +1,55 @@
+#include <stdint.h>
+#include <stddef.h>
+
+//Filter types for each scanline
+//As defined here: https://www.w3.org/TR/png/#9Filter-types
+#define FILTER_NONE 0
+#define FILTER_SUB 1
+#define FILTER_UP 2
+#define FILTER_AVERAGE 3
+#define FILTER_PAETH 4
+
+//Strategies for filter_image past the fixed filter types.  Both pick a filter type per scanline
+#define FILTER_STRATEGY_MINSUM 5
+#define FILTER_STRATEGY_ENTROPY 6
+#define NUM_FILTER_STRATEGIES 7
+
+uint8_t paeth_predictor(int a, int b, int c);
+
+void filter_row(uint8_t filter_type, uint8_t* row, uint8_t* prev, uint8_t* out, int row_len, int bpp);
+
+extern int (*unfilter_row)(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+
+int unfilter_row_scalar(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+
+#if defined(__x86_64__) || defined(__i386__)
+int unfilter_row_sse2(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+#endif
+
+int unfilter_row_bpp1(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+int unfilter_row_bpp2(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+int unfilter_row_bpp3(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+int unfilter_row_bpp4(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+int unfilter_row_bpp6(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+int unfilter_row_bpp8(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+
+#if defined(__x86_64__) || defined(__i386__)
+int unfilter_row_bpp1_sse2(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+int unfilter_row_bpp2_sse2(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+int unfilter_row_bpp3_sse2(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+int unfilter_row_bpp4_sse2(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+int unfilter_row_bpp6_sse2(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+int unfilter_row_bpp8_sse2(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+#endif
+
+int (*row_unfilterer(uint8_t color_type, uint8_t bit_depth))(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);
+
+int bits_per_pixel(uint8_t color_type, uint8_t bit_depth);
+
+size_t scanline_bytes(int width, int bits);
+
+long minsum_score(uint8_t* filtered, int row_len);
+
+double entropy_score(uint8_t* filtered, int row_len);
+
+uint8_t* filter_image(uint8_t* pixels, int height, int row_len, int bpp, int strategy);
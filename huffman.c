@@ -188,3 +188,112 @@ void generate_codes_from_SFD(struct SFD sfds[], int len, struct CodeLength tree[
     free(bit_lengths);
     bit_lengths = NULL;
 }
+
+/**
+ * Compares if leaf a has a higher weight than leaf b.  Ties are broken by symbol so the result is stable
+ * @return positive if a sorts after b
+*/
+int weight_comp(const void* a, const void* b) {
+    struct PMNode* _a = (struct PMNode*) a;
+    struct PMNode* _b = (struct PMNode*) b;
+    if (_a->weight != _b->weight) return _a->weight > _b->weight ? 1 : -1;
+    return _a->symbol - _b->symbol;
+}
+
+/**
+ * Adds one to the bit length of every leaf below the given package-merge node
+ * @param struct PMNode* nodes is the node pool
+ * @param int node is the node to count
+ * @param int* bit_length is the bit_length array where index is the symbol
+*/
+void count_pm_leaves(struct PMNode* nodes, int node, int* bit_length) {
+    while (nodes[node].symbol < 0) {
+        count_pm_leaves(nodes, nodes[node].left, bit_length);
+        node = nodes[node].right;
+    }
+    bit_length[nodes[node].symbol] += 1;
+}
+
+/**
+ * Returns the bit_length array where index is the symbol of the bit_length, with no length over max_bits.
+ * Uses the package-merge algorithm so the lengths are optimal under the limit.  Symbols with freq 0 get length 0.
+ * A single used symbol gets length 1 since Deflate has no 0 bit codes
+ * @param int freqs[] is the frequency of each symbol where index is the symbol
+ * @param int len is the len of the array
+ * @param int max_bits is the longest allowed code.  2^max_bits must be at least the number of used symbols
+ * @return the MALLOCED bit_length array where index is the symbol of the bit_length
+*/
+int* huffman_length_limited(int freqs[], int len, int max_bits) {
+    int* bit_length = calloc(len, sizeof(int));
+
+    //leaves for every used symbol
+    struct PMNode* leaves = malloc(len * sizeof(struct PMNode));
+    int leaf_count = 0;
+    for (int i = 0; i < len; i++) {
+        if (freqs[i] > 0) {
+            leaves[leaf_count].weight = freqs[i];
+            leaves[leaf_count].symbol = i;
+            leaves[leaf_count].left = -1;
+            leaves[leaf_count].right = -1;
+            leaf_count++;
+        }
+    }
+
+    if (leaf_count <= 1) {
+        if (leaf_count == 1) bit_length[leaves[0].symbol] = 1;
+        free(leaves);
+        return bit_length;
+    }
+
+    qsort((void *) leaves, leaf_count, sizeof(struct PMNode), weight_comp);
+
+    //node pool holds the leaves then every package made.  Each level adds at most leaf_count - 1 packages
+    int pool_cap = leaf_count * (max_bits + 1);
+    struct PMNode* nodes = malloc(pool_cap * sizeof(struct PMNode));
+    memcpy(nodes, leaves, leaf_count * sizeof(struct PMNode));
+    int node_count = leaf_count;
+
+    int* list = malloc(2 * leaf_count * sizeof(int));
+    int* next_list = malloc(2 * leaf_count * sizeof(int));
+    int list_len = leaf_count;
+    for (int i = 0; i < leaf_count; i++) list[i] = i;
+
+    for (int level = 1; level < max_bits; level++) {
+        //package adjacent pairs then merge the packages with the leaves by weight
+        int package_start = node_count;
+        for (int i = 0; i + 1 < list_len; i += 2) {
+            nodes[node_count].weight = nodes[list[i]].weight + nodes[list[i + 1]].weight;
+            nodes[node_count].symbol = -1;
+            nodes[node_count].left = list[i];
+            nodes[node_count].right = list[i + 1];
+            node_count++;
+        }
+
+        int leaf = 0;
+        int package = package_start;
+        int next_len = 0;
+        while (leaf < leaf_count || package < node_count) {
+            if (package >= node_count || (leaf < leaf_count && nodes[leaf].weight <= nodes[package].weight)) {
+                next_list[next_len++] = leaf++;
+            } else {
+                next_list[next_len++] = package++;
+            }
+        }
+
+        int* tmp = list;
+        list = next_list;
+        next_list = tmp;
+        list_len = next_len;
+    }
+
+    //the first 2n - 2 items of the last list hold every code bit
+    for (int i = 0; i < 2 * leaf_count - 2; i++) {
+        count_pm_leaves(nodes, list[i], bit_length);
+    }
+
+    free(list);
+    free(next_list);
+    free(nodes);
+    free(leaves);
+    return bit_length;
+}
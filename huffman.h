@@ -14,6 +14,14 @@ struct SFD {
     int depth;
 };
 
+//Node used by package-merge.  symbol of -1 means it is a package of left and right
+struct PMNode {
+    long weight;
+    int symbol;
+    int left;
+    int right;
+};
+
 struct Basket {
     int total_freq;
     struct SFD* content;
@@ -40,3 +48,8 @@ void generate_codes_from_bl(int* bit_lengths, int len, struct CodeLength tree[])
 
 void generate_codes_from_SFD(struct SFD sfds[], int len, struct CodeLength tree[286]);
 
+int weight_comp(const void* a, const void* b);
+
+void count_pm_leaves(struct PMNode* nodes, int node, int* bit_length);
+
+int* huffman_length_limited(int freqs[], int len, int max_bits);
@@ -1,51 +1,45 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <malloc.h>
-#include <winsock.h>
 #include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "huffman.h"
 #include "deflate.h"
 #include "inflate.h"
 #include "LZ77.h"
+#include "checksum.h"
+#include "cpu.h"
 
 
-#define BLOCK_ZERO_MAX 65535
-
 /**
  * Constructs the tree to decode a prefix code bit by bit
  * @param struct DecodeTree* LL_tree is the decode tree to be made
  * @param struct CodeLength* CL_table is the encode table to construct the tree from
  * @param Fint tree_len is the number of symbols in the tree
 */ 
-void make_decode_tree(struct DecodeTree* root, struct CodeLength* CL_table, int tree_len) {\
+void make_decode_tree(struct DecodeTree* root, struct CodeLength* CL_table, int tree_len) {
     int path;
     struct DecodeTree* curTree = root;
     for (int i = 0; i < tree_len; i++) {
+        if (!CL_table[i].Len) continue; //unused symbols have no code
+
         for (int j = CL_table[i].Len; j > 0; j--) {
             path = CL_table[i].Code & (1 << (j - 1)); //get the bits of the code left to right
 
-            //make the next branch node
-            struct DecodeTree* child = malloc(sizeof(struct DecodeTree));
-            child->val = -1;
-            child->zero = NULL;
-            child->one = NULL;
-
-            if (path) {
-                if (curTree->one == NULL) {
-                    curTree->one = child;
-                    curTree = child;
-                } else {
-                    curTree = curTree->one;
-                }
-            } else {
-                if (curTree->zero == NULL) {
-                    curTree->zero = child;
-                    curTree = child;
-                } else {
-                    curTree = curTree->zero;
-                }
+            struct DecodeTree** next = path ? &curTree->one : &curTree->zero;
+            if (*next == NULL) { //make the next branch node
+                struct DecodeTree* child = malloc(sizeof(struct DecodeTree));
+                child->val = -1;
+                child->zero = NULL;
+                child->one = NULL;
+                child->table = NULL;
+                *next = child;
             }
+            curTree = *next;
         }
         curTree->val = i; //curTree is now the leaf that will hold the symbol
         curTree = root; //go back to the root
@@ -250,7 +244,593 @@ void read_data(char* data, FILE* fp) {
     }
 }
 
+/**
+ * Makes an empty decode tree root
+ * @return the MALLOCED root
+*/
+struct DecodeTree* new_decode_tree() {
+    struct DecodeTree* root = malloc(sizeof(struct DecodeTree));
+    root->val = -1;
+    root->zero = NULL;
+    root->one = NULL;
+    root->table = NULL;
+    return root;
+}
+
+/**
+ * Frees a decode tree and every node below it
+ * @param struct DecodeTree* root is the tree to free
+*/
+void free_decode_tree(struct DecodeTree* root) {
+    if (root == NULL) return;
+    free_decode_tree(root->zero);
+    free_decode_tree(root->one);
+    free(root->table);
+    free(root);
+}
+
+/**
+ * Checks that a list of code lengths is not over-subscribed so it can be made into a prefix code
+ * @param int* lengths is the code length of each symbol
+ * @param int len is the number of symbols
+ * @return -1 if the lengths are over-subscribed 0 otherwise
+*/
+int check_code_lengths(int* lengths, int len) {
+    int bl_count[16] = {0};
+    for (int i = 0; i < len; i++) bl_count[lengths[i]]++;
+
+    int left = 1;
+    for (int bits = 1; bits < 16; bits++) {
+        left = (left << 1) - bl_count[bits];
+        if (left < 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Builds a decode tree from a list of code lengths
+ * @param int* lengths is the code length of each symbol
+ * @param int len is the number of symbols
+ * @return the MALLOCED decode tree or NULL if the lengths are over-subscribed
+*/
+struct DecodeTree* decode_tree_from_lengths(int* lengths, int len) {
+    if (check_code_lengths(lengths, len)) return NULL;
+
+    struct CodeLength table[288] = {{0}};
+    generate_codes_from_bl(lengths, len, table);
+
+    struct DecodeTree* root = new_decode_tree();
+    make_decode_tree(root, table, len);
+    return root;
+}
+
+/**
+ * Records a stream error.  Only the first error is printed
+ * @param struct InflateStream* s is the stream
+ * @param char* message is the error message
+*/
+void stream_error(struct InflateStream* s, char* message) {
+    if (!s->error) fprintf(stderr, "%s\n", message);
+    s->error = 1;
+    s->state = STREAM_DONE;
+}
+
+/**
+ * Gets the next compressed byte, asking for more input when the current input runs out
+ * @param struct InflateStream* s is the stream
+ * @return the next byte or -1 if there is no more input
+*/
+int stream_next_byte(struct InflateStream* s) {
+    while (s->in_pos == s->in_len) {
+        if (s->error || !s->refill(s->ctx, &s->in, &s->in_len)) {
+            stream_error(s, "UNEXPECTED END OF COMPRESSED DATA");
+            return -1;
+        }
+        s->in_pos = 0;
+    }
+    return s->in[s->in_pos++];
+}
+
+/**
+ * Reads the next num_bits many bits as a number, least significant bit first (3.1.1)
+ * @param struct InflateStream* s is the stream
+ * @param int num_bits is the number of bits to read, at most 16
+ * @return the number stored in the bits or 0 if the input ran out
+*/
+uint32_t stream_bits(struct InflateStream* s, int num_bits) {
+    while (s->bit_count < num_bits) {
+        int byte = stream_next_byte(s);
+        if (byte < 0) return 0;
+        s->bit_buf |= (uint32_t) byte << s->bit_count;
+        s->bit_count += 8;
+    }
+    uint32_t value = s->bit_buf & ((1u << num_bits) - 1);
+    s->bit_buf >>= num_bits;
+    s->bit_count -= num_bits;
+    return value;
+}
+
+/**
+ * Gets at least num_bits bits into the bit buffer without using any of them
+ * @param struct InflateStream* s is the stream
+ * @param int num_bits is the number of bits wanted, at most 24
+ * @return 0 if the input ran out first 1 otherwise.  Running out is not an error here since the last code of the
+ * stream can be shorter than num_bits
+*/
+int stream_fill_bits(struct InflateStream* s, int num_bits) {
+    while (s->bit_count < num_bits) {
+        if (s->in_pos == s->in_len) {
+            if (s->error || !s->refill(s->ctx, &s->in, &s->in_len)) return 0;
+            s->in_pos = 0;
+            continue;
+        }
+        s->bit_buf |= (uint32_t) s->in[s->in_pos++] << s->bit_count;
+        s->bit_count += 8;
+    }
+    return 1;
+}
+
+/**
+ * Decodes the rest of a symbol by walking the tree one bit at a time.  Prefix codes are packed starting with their
+ * most significant bit so each bit read is the next branch
+ * @param struct InflateStream* s is the stream
+ * @param struct DecodeTree* node is the root, or the branch reached by the bits already used
+ * @return the symbol or -1 if the bits are not a code in the tree
+*/
+int stream_walk_tree(struct InflateStream* s, struct DecodeTree* node) {
+    do {
+        node = stream_bits(s, 1) ? node->one : node->zero;
+        if (node == NULL || s->error) {
+            stream_error(s, "INVALID PREFIX CODE IN COMPRESSED DATA");
+            return -1;
+        }
+    } while (node->zero || node->one);
+    return node->val;
+}
+
+/**
+ * Builds the table of where every DECODE_TABLE_BITS bit pattern leads in a tree.  Bits are used lowest first, the
+ * order they come out of the bit buffer
+ * @param struct DecodeTree* root is the tree
+*/
+void build_decode_table(struct DecodeTree* root) {
+    root->table = malloc(sizeof(struct DecodeEntry) << DECODE_TABLE_BITS);
+    for (int i = 0; i < 1 << DECODE_TABLE_BITS; i++) {
+        struct DecodeTree* node = root;
+        int bits = 0;
+        while (node && (node->zero || node->one) && bits < DECODE_TABLE_BITS) {
+            node = (i >> bits) & 1 ? node->one : node->zero;
+            bits++;
+        }
+        root->table[i].node = bits ? node : NULL; //a tree with no codes at all
+        root->table[i].bits = bits;
+    }
+}
+
+//Decodes the next symbol by looking up DECODE_TABLE_BITS bits at once and only walking the tree for longer codes.
+//LOW_BITS(x, n) keeps the lowest n bits of x so the BMI2 version can use BZHI
+#define DEFINE_TABLE_DECODER(NAME, ATTRIBUTES, LOW_BITS) \
+ATTRIBUTES int NAME(struct InflateStream* s, struct DecodeTree* root) { \
+    if (root->table == NULL) build_decode_table(root); \
+    if (!stream_fill_bits(s, DECODE_TABLE_BITS)) return stream_walk_tree(s, root); /*near the end of the input*/ \
+    struct DecodeEntry entry = root->table[LOW_BITS(s->bit_buf, DECODE_TABLE_BITS)]; \
+    if (entry.node == NULL) { \
+        stream_error(s, "INVALID PREFIX CODE IN COMPRESSED DATA"); \
+        return -1; \
+    } \
+    s->bit_buf >>= entry.bits; \
+    s->bit_count -= entry.bits; \
+    if (entry.node->zero || entry.node->one) return stream_walk_tree(s, entry.node); \
+    return entry.node->val; \
+}
+
+#define MASK_LOW_BITS(x, n) ((x) & ((1u << (n)) - 1))
+DEFINE_TABLE_DECODER(stream_decode_sym_table, , MASK_LOW_BITS)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BZHI_LOW_BITS(x, n) _bzhi_u32(x, n)
+DEFINE_TABLE_DECODER(stream_decode_sym_bmi2, __attribute__((target("bmi2"))), BZHI_LOW_BITS)
+#endif
+
+//Point at the fastest version init_cpu_dispatch finds for this CPU
+int (*stream_decode_sym)(struct InflateStream* s, struct DecodeTree* root) = stream_decode_sym_table;
+void (*copy_match)(struct InflateStream* s, uint8_t* out, int len) = copy_match_scalar;
+
+/**
+ * Copies len bytes of the current <length, distance> pair from the window into the window and out one byte at a time
+ * @param struct InflateStream* s is the stream
+ * @param uint8_t* out is where the bytes go
+ * @param int len is the number of bytes to copy, at most s->copy_len
+*/
+void copy_match_scalar(struct InflateStream* s, uint8_t* out, int len) {
+    for (int i = 0; i < len; i++) {
+        uint8_t byte = s->window[(s->total_out - s->copy_dist) % WINDOW_SIZE];
+        s->window[s->total_out++ % WINDOW_SIZE] = byte;
+        out[i] = byte;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * Copies len bytes of the current <length, distance> pair 16 bytes at a time.  The window is split into pieces that
+ * do not wrap, and distances under 16 are copied a byte at a time since the bytes being read are still being written
+ * @param struct InflateStream* s is the stream
+ * @param uint8_t* out is where the bytes go
+ * @param int len is the number of bytes to copy, at most s->copy_len
+*/
+__attribute__((target("sse2")))
+void copy_match_sse2(struct InflateStream* s, uint8_t* out, int len) {
+    while (len > 0) {
+        size_t to = s->total_out % WINDOW_SIZE;
+        size_t from = (s->total_out - s->copy_dist) % WINDOW_SIZE;
+        size_t n = len;
+        if (n > WINDOW_SIZE - to) n = WINDOW_SIZE - to;
+        if (n > WINDOW_SIZE - from) n = WINDOW_SIZE - from;
+
+        size_t i = 0;
+        if (s->copy_dist >= 16) {
+            for (; i + 16 <= n; i += 16) {
+                _mm_storeu_si128((__m128i*) (s->window + to + i), _mm_loadu_si128((__m128i*) (s->window + from + i)));
+            }
+        }
+        for (; i < n; i++) s->window[to + i] = s->window[from + i];
+
+        memcpy(out, s->window + to, n);
+        out += n;
+        len -= n;
+        s->total_out += n;
+    }
+}
+#endif
+
+/**
+ * Hashes the code lengths of a block of type 2 with FNV-1a
+ * @param int* lengths is the LL code lengths followed by the distance code lengths
+ * @param int hlit is the number of LL code lengths
+ * @param int hdist is the number of distance code lengths
+ * @return the hash
+*/
+uint32_t hash_code_lengths(int* lengths, int hlit, int hdist) {
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ hlit) * 16777619u;
+    hash = (hash ^ hdist) * 16777619u;
+    for (int i = 0; i < hlit + hdist; i++) {
+        hash = (hash ^ lengths[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Looks for trees already built from the same code lengths
+ * @param struct InflateStream* s is the stream
+ * @param int* lengths is the LL code lengths followed by the distance code lengths
+ * @param int hlit is the number of LL code lengths
+ * @param int hdist is the number of distance code lengths
+ * @return the cache entry or NULL if the trees have not been built
+*/
+struct TreeCacheEntry* find_cached_trees(struct InflateStream* s, int* lengths, int hlit, int hdist) {
+    uint32_t hash = hash_code_lengths(lengths, hlit, hdist);
+    for (int i = 0; i < s->tree_cache_len; i++) {
+        struct TreeCacheEntry* entry = &s->tree_cache[i];
+        if (entry->hash != hash || entry->hlit != hlit || entry->hdist != hdist) continue;
+
+        int same = 1;
+        for (int k = 0; k < hlit + hdist && same; k++) same = entry->lengths[k] == lengths[k];
+        if (same) {
+            entry->last_used = ++s->tree_cache_clock;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Adds newly built trees to the cache.  When the cache is full the least recently used trees are freed
+ * @param struct InflateStream* s is the stream
+ * @param int* lengths is the LL code lengths followed by the distance code lengths
+ * @param int hlit is the number of LL code lengths
+ * @param int hdist is the number of distance code lengths
+ * @param struct DecodeTree* LL_tree is the LL tree built from the lengths.  Now owned by the cache
+ * @param struct DecodeTree* distance_tree is the distance tree built from the lengths.  Now owned by the cache
+ * @return the cache entry holding the trees
+*/
+struct TreeCacheEntry* cache_trees(struct InflateStream* s, int* lengths, int hlit, int hdist, struct DecodeTree* LL_tree, struct DecodeTree* distance_tree) {
+    struct TreeCacheEntry* entry;
+    if (s->tree_cache_len < TREE_CACHE_SIZE) {
+        entry = &s->tree_cache[s->tree_cache_len++];
+    } else {
+        entry = &s->tree_cache[0];
+        for (int i = 1; i < TREE_CACHE_SIZE; i++) {
+            if (s->tree_cache[i].last_used < entry->last_used) entry = &s->tree_cache[i];
+        }
+        free_decode_tree(entry->LL_tree);
+        free_decode_tree(entry->distance_tree);
+    }
+
+    entry->hash = hash_code_lengths(lengths, hlit, hdist);
+    entry->hlit = hlit;
+    entry->hdist = hdist;
+    for (int i = 0; i < hlit + hdist; i++) entry->lengths[i] = lengths[i];
+    entry->LL_tree = LL_tree;
+    entry->distance_tree = distance_tree;
+    entry->last_used = ++s->tree_cache_clock;
+    return entry;
+}
+
+/**
+ * Adds a stream's counters to the stats of a decode
+ * @param struct InflateStream* s is the stream
+ * @param struct InflateStats* stats is added to.  Nothing is done if it is NULL
+*/
+void add_inflate_stats(struct InflateStream* s, struct InflateStats* stats) {
+    if (stats == NULL) return;
+    stats->tree_cache_hits += s->tree_cache_hits;
+    stats->tree_cache_misses += s->tree_cache_misses;
+}
+
+/**
+ * Prints how often blocks of type 2 reused trees from the cache
+ * @param struct InflateStats* stats is the counters of a decode
+ * @param FILE* fp is where to print
+*/
+void report_tree_cache(struct InflateStats* stats, FILE* fp) {
+    unsigned long blocks = stats->tree_cache_hits + stats->tree_cache_misses;
+    fprintf(fp, "Huffman tree cache: %lu hits, %lu misses (%.1f%% hit rate over %lu dynamic blocks)\n",
+            stats->tree_cache_hits, stats->tree_cache_misses, blocks ? 100.0 * stats->tree_cache_hits / blocks : 0.0, blocks);
+}
+
+/**
+ * Reads the code lengths of a block of type 2 and gets its LL and distance trees (3.2.7).
+ * Trees are only built the first time a set of code lengths is seen, after that they come from the cache
+ * @param struct InflateStream* s is the stream.  Must be just after the 3 bit block header
+ * @return -1 if the header is invalid 0 otherwise
+*/
+int read_dynamic_trees(struct InflateStream* s) {
+    int hlit = stream_bits(s, 5) + 257;
+    int hdist = stream_bits(s, 5) + 1;
+    int hclen = stream_bits(s, 4) + 4;
+    if (hlit > 286 || hdist > 30) {
+        stream_error(s, "TOO MANY CODE LENGTHS IN BLOCK TYPE '10'");
+        return -1;
+    }
+
+    int cl_lengths[19] = {0};
+    for (int i = 0; i < hclen; i++) {
+        cl_lengths[code_length_order[i]] = stream_bits(s, 3);
+    }
+    struct DecodeTree* cl_tree = decode_tree_from_lengths(cl_lengths, 19);
+    if (cl_tree == NULL) {
+        stream_error(s, "INVALID CODE LENGTH CODE IN BLOCK TYPE '10'");
+        return -1;
+    }
+
+    //the LL and distance lengths are one sequence so repeats can cross between them
+    int lengths[286 + 30] = {0};
+    int n = 0;
+    while (n < hlit + hdist && !s->error) {
+        int sym = stream_decode_sym(s, cl_tree);
+        int repeat = 0;
+        int value = 0;
+        if (sym < 0) {
+            break;
+        } else if (sym < 16) {
+            lengths[n++] = sym;
+            continue;
+        } else if (sym == 16) {
+            if (n == 0) {
+                stream_error(s, "REPEAT WITH NO PREVIOUS CODE LENGTH IN BLOCK TYPE '10'");
+                break;
+            }
+            value = lengths[n - 1];
+            repeat = 3 + stream_bits(s, 2);
+        } else if (sym == 17) {
+            repeat = 3 + stream_bits(s, 3);
+        } else {
+            repeat = 11 + stream_bits(s, 7);
+        }
+
+        if (n + repeat > hlit + hdist) {
+            stream_error(s, "CODE LENGTHS OVERFLOW IN BLOCK TYPE '10'");
+            break;
+        }
+        while (repeat--) lengths[n++] = value;
+    }
+    free_decode_tree(cl_tree);
+    if (s->error) return -1;
+
+    if (lengths[256] == 0) {
+        stream_error(s, "NO END OF BLOCK CODE IN BLOCK TYPE '10'");
+        return -1;
+    }
+
+    struct TreeCacheEntry* entry = find_cached_trees(s, lengths, hlit, hdist);
+    if (entry) {
+        s->tree_cache_hits++;
+    } else {
+        s->tree_cache_misses++;
+        struct DecodeTree* LL_tree = decode_tree_from_lengths(lengths, hlit);
+        struct DecodeTree* distance_tree = decode_tree_from_lengths(lengths + hlit, hdist);
+        if (LL_tree == NULL || distance_tree == NULL) {
+            free_decode_tree(LL_tree);
+            free_decode_tree(distance_tree);
+            stream_error(s, "OVER-SUBSCRIBED CODE IN BLOCK TYPE '10'");
+            return -1;
+        }
+        entry = cache_trees(s, lengths, hlit, hdist, LL_tree, distance_tree);
+    }
+
+    s->LL_tree = entry->LL_tree;
+    s->distance_tree = entry->distance_tree;
+    return 0;
+}
+
+/**
+ * Forgets the trees of the current block.  They are owned by the tree cache or are the fixed trees
+ * @param struct InflateStream* s is the stream
+*/
+void release_block_trees(struct InflateStream* s) {
+    s->LL_tree = NULL;
+    s->distance_tree = NULL;
+}
+
+/**
+ * Reads the next block header and gets ready to read the block
+ * @param struct InflateStream* s is the stream
+*/
+void read_stream_block_header(struct InflateStream* s) {
+    s->final = stream_bits(s, 1);
+    int BTYPE = stream_bits(s, 2);
+    if (s->error) return;
+
+    if (!BTYPE) { //block 0 (3.2.4)
+        s->bit_buf >>= s->bit_count % 8; //skip to the next byte boundary
+        s->bit_count -= s->bit_count % 8;
+        int LEN = stream_bits(s, 16);
+        int NLEN = stream_bits(s, 16);
+        if (LEN != (~NLEN & 0xffff)) {
+            stream_error(s, "NLEN is not LEN's one's complement in Block Type '00'");
+            return;
+        }
+        s->stored_left = LEN;
+        s->state = STREAM_STORED;
+    } else if (BTYPE == 1) { //block 1
+        if (s->fixed_LL_tree == NULL) {
+            s->fixed_LL_tree = new_decode_tree();
+            s->fixed_distance_tree = new_decode_tree();
+            make_BT_ONE_LL_decode_tree(s->fixed_LL_tree);
+            make_BT_ONE_distance_decode_tree(s->fixed_distance_tree);
+        }
+        s->LL_tree = s->fixed_LL_tree;
+        s->distance_tree = s->fixed_distance_tree;
+        s->state = STREAM_HUFFMAN;
+    } else if (BTYPE == 2) { //block 2
+        if (!read_dynamic_trees(s)) s->state = STREAM_HUFFMAN;
+    } else { //reserved
+        stream_error(s, "INVALID BLOCK TYPE '11' ENCOUNTERED");
+    }
+}
+
+/**
+ * Starts reading a zlib stream (RFC 1950) whose compressed bytes are handed over a piece at a time by refill.
+ * Only the 32K window is kept so memory does not depend on the size of the stream
+ * @param struct InflateStream* s is the stream to set up
+ * @param int (*refill)(void* ctx, uint8_t** buf, size_t* len) sets buf and len to the next compressed bytes. Returns 0 when there are no more
+ * @param void* ctx is passed to refill
+*/
+void inflate_init(struct InflateStream* s, int (*refill)(void* ctx, uint8_t** buf, size_t* len), void* ctx) {
+    memset(s, 0, sizeof(struct InflateStream));
+    s->refill = refill;
+    s->ctx = ctx;
+    s->state = STREAM_HEADER;
+    s->adler = 1;
+    init_cpu_dispatch();
+}
+
+/**
+ * Decompresses up to len bytes into out
+ * @param struct InflateStream* s is the stream
+ * @param uint8_t* out is where the uncompressed bytes go
+ * @param size_t len is the number of bytes wanted
+ * @return the number of bytes written.  Less than len only at the end of the stream or on error (s->error is set)
+*/
+size_t inflate_read(struct InflateStream* s, uint8_t* out, size_t len) {
+    size_t produced = 0;
+    size_t checked = 0; //bytes of out already added to the Adler-32
+    while (produced < len && s->state != STREAM_DONE) {
+        if (s->state == STREAM_HEADER) {
+            int CMF = stream_bits(s, 8);
+            int FLG = stream_bits(s, 8);
+            if ((CMF & 0x0f) != 8 || (CMF >> 4) > 7 || ((CMF << 8) | FLG) % 31 || (FLG & 0x20)) {
+                stream_error(s, "INVALID ZLIB HEADER");
+                break;
+            }
+            s->state = STREAM_BLOCK_HEADER;
+        } else if (s->state == STREAM_BLOCK_HEADER) {
+            if (s->final) {
+                s->state = STREAM_TRAILER;
+            } else {
+                read_stream_block_header(s);
+            }
+        } else if (s->state == STREAM_STORED) {
+            if (!s->stored_left) {
+                s->state = STREAM_BLOCK_HEADER;
+                continue;
+            }
+            uint8_t byte = stream_bits(s, 8);
+            s->window[s->total_out++ % WINDOW_SIZE] = byte;
+            out[produced++] = byte;
+            s->stored_left--;
+        } else if (s->state == STREAM_HUFFMAN) {
+            if (s->copy_len) { //finish as much of the <length, distance> pair as fits before decoding more
+                int n = len - produced < (size_t) s->copy_len ? (int) (len - produced) : s->copy_len;
+                copy_match(s, out + produced, n);
+                produced += n;
+                s->copy_len -= n;
+                continue;
+            }
+
+            int sym = stream_decode_sym(s, s->LL_tree);
+            if (sym < 0) break;
+            if (sym < 256) { //literal
+                s->window[s->total_out++ % WINDOW_SIZE] = sym;
+                out[produced++] = sym;
+            } else if (sym == 256) { //end of block reached
+                release_block_trees(s);
+                s->state = STREAM_BLOCK_HEADER;
+            } else if (sym > 285) {
+                stream_error(s, "INVALID LENGTH SYMBOL");
+            } else { //length
+                int len_sym = sym - 257;
+                s->copy_len = length_base[len_sym] + stream_bits(s, length_extra[len_sym]);
+                int dist_sym = stream_decode_sym(s, s->distance_tree);
+                if (dist_sym < 0) break;
+                if (dist_sym > 29) {
+                    stream_error(s, "INVALID DISTANCE SYMBOL");
+                    break;
+                }
+                s->copy_dist = distance_base[dist_sym] + stream_bits(s, distance_extra[dist_sym]);
+                if ((size_t) s->copy_dist > s->total_out) {
+                    stream_error(s, "DISTANCE TOO FAR BACK");
+                }
+            }
+        } else if (s->state == STREAM_TRAILER) {
+            s->bit_buf >>= s->bit_count % 8; //skip to the next byte boundary
+            s->bit_count -= s->bit_count % 8;
+            uint32_t adler = stream_bits(s, 8) << 24;
+            adler |= stream_bits(s, 8) << 16;
+            adler |= stream_bits(s, 8) << 8;
+            adler |= stream_bits(s, 8);
+
+            s->adler = adler32_update(s->adler, out + checked, produced - checked);
+            checked = produced;
+            if (!s->error && adler != s->adler) stream_error(s, "ADLER-32 MISMATCH");
+            s->state = STREAM_DONE;
+        }
+    }
+
+    s->adler = adler32_update(s->adler, out + checked, produced - checked);
+    return produced;
+}
+
+/**
+ * Frees everything the stream allocated
+ * @param struct InflateStream* s is the stream
+*/
+void inflate_end(struct InflateStream* s) {
+    release_block_trees(s);
+    for (int i = 0; i < s->tree_cache_len; i++) {
+        free_decode_tree(s->tree_cache[i].LL_tree);
+        free_decode_tree(s->tree_cache[i].distance_tree);
+    }
+    s->tree_cache_len = 0;
+    free_decode_tree(s->fixed_LL_tree);
+    free_decode_tree(s->fixed_distance_tree);
+    s->fixed_LL_tree = NULL;
+    s->fixed_distance_tree = NULL;
+}
 
+//scratch test of the BT 1 decode tree.  The decode program's main is in decode.c
+#ifdef INFLATE_MAIN
 int main () {
     struct DecodeTree LL_tree;
     LL_tree.val = -1;
@@ -266,3 +846,4 @@ int main () {
     uint16_t sym = decode_from_tree(data, &cur_byte, &byte_offset, &LL_tree);
     printf("%d", sym);
 }
+#endif
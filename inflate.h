@@ -1,9 +1,113 @@
 #include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define DECODE_TABLE_BITS 9  //bits looked up at once before walking the rest of a longer code
 
 struct DecodeTree {
     int val;    //val of -1 means its just a branch and holds no prefix code
     struct DecodeTree* zero;
     struct DecodeTree* one;
+    struct DecodeEntry* table;  //only on roots, built the first time the tree is used.  NULL until then
+};
+
+//Where the next DECODE_TABLE_BITS bits lead in a decode tree
+struct DecodeEntry {
+    struct DecodeTree* node;    //the leaf, or the branch to keep walking from.  NULL if the bits are not a code
+    int bits;                   //bits used to reach node
+};
+
+//Where an InflateStream is in the zlib stream
+#define STREAM_HEADER 0
+#define STREAM_BLOCK_HEADER 1
+#define STREAM_STORED 2
+#define STREAM_HUFFMAN 3
+#define STREAM_TRAILER 4
+#define STREAM_DONE 5
+
+#define TREE_CACHE_SIZE 8   //most sets of dynamic block trees kept per stream
+
+//LL and distance trees built for one set of dynamic block code lengths
+struct TreeCacheEntry {
+    uint32_t hash;
+    int hlit;
+    int hdist;
+    uint8_t lengths[286 + 30];
+    struct DecodeTree* LL_tree;
+    struct DecodeTree* distance_tree;
+    unsigned long last_used;
+};
+
+//A zlib stream decoded a piece at a time.  Holds only the 32K window and the trees of recent blocks
+struct InflateStream {
+    int (*refill)(void* ctx, uint8_t** buf, size_t* len);
+    void* ctx;
+    uint8_t* in;
+    size_t in_len;
+    size_t in_pos;
+
+    uint32_t bit_buf;   //bits read from in but not used yet, next bit is the lowest
+    int bit_count;
+
+    int state;
+    int final;          //BFINAL of the current block
+    int error;
+    size_t stored_left; //bytes left in a block of type 0
+    int copy_len;       //bytes left to copy from the current <length, distance> pair
+    int copy_dist;
+
+    struct DecodeTree* LL_tree;
+    struct DecodeTree* distance_tree;
+    struct DecodeTree* fixed_LL_tree;       //built the first time a block of type 1 is seen
+    struct DecodeTree* fixed_distance_tree;
+
+    struct TreeCacheEntry tree_cache[TREE_CACHE_SIZE];
+    int tree_cache_len;
+    unsigned long tree_cache_clock;
+    unsigned long tree_cache_hits;
+    unsigned long tree_cache_misses;
+
+    uint8_t window[WINDOW_SIZE];
+    size_t total_out;
+    uint32_t adler;
+};
+
+//Counters of a decode handed back to the caller.  Added up over every stream of the decode
+struct InflateStats {
+    unsigned long tree_cache_hits;      //blocks of type 2 that reused cached trees
+    unsigned long tree_cache_misses;    //blocks of type 2 that built their own trees
 };
 
-uint16_t decode_from_tree(char* data, int* cur_byte, uint8_t* byte_offset, struct DecodeTree* root);
\ No newline at end of file
+uint16_t decode_from_tree(char* data, int* cur_byte, uint8_t* byte_offset, struct DecodeTree* root);
+
+void make_decode_tree(struct DecodeTree* root, struct CodeLength* CL_table, int tree_len);
+
+struct DecodeTree* new_decode_tree();
+
+void free_decode_tree(struct DecodeTree* root);
+
+struct DecodeTree* decode_tree_from_lengths(int* lengths, int len);
+
+void inflate_init(struct InflateStream* s, int (*refill)(void* ctx, uint8_t** buf, size_t* len), void* ctx);
+
+size_t inflate_read(struct InflateStream* s, uint8_t* out, size_t len);
+
+void add_inflate_stats(struct InflateStream* s, struct InflateStats* stats);
+
+void report_tree_cache(struct InflateStats* stats, FILE* fp);
+
+extern int (*stream_decode_sym)(struct InflateStream* s, struct DecodeTree* root);
+
+extern void (*copy_match)(struct InflateStream* s, uint8_t* out, int len);
+
+int stream_decode_sym_table(struct InflateStream* s, struct DecodeTree* root);
+
+void copy_match_scalar(struct InflateStream* s, uint8_t* out, int len);
+
+#if defined(__x86_64__) || defined(__i386__)
+int stream_decode_sym_bmi2(struct InflateStream* s, struct DecodeTree* root);
+
+void copy_match_sse2(struct InflateStream* s, uint8_t* out, int len);
+#endif
+
+void inflate_end(struct InflateStream* s);
@@ -0,0 +1,111 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "interlace.h"
+#include "convert.h"
+
+//Where each pass starts and how far apart its pixels are
+//As defined here: https://www.w3.org/TR/png/#8Interlace
+int adam7_x_start[ADAM7_PASSES] = {0, 4, 0, 2, 0, 1, 0};
+int adam7_y_start[ADAM7_PASSES] = {0, 0, 4, 0, 2, 0, 1};
+int adam7_x_step[ADAM7_PASSES] = {8, 8, 4, 4, 2, 2, 1};
+int adam7_y_step[ADAM7_PASSES] = {8, 8, 8, 4, 4, 2, 2};
+
+//Area each pixel stands in for until a later pass refines it
+int adam7_block_width[ADAM7_PASSES] = {8, 4, 4, 2, 2, 1, 1};
+int adam7_block_height[ADAM7_PASSES] = {8, 8, 4, 4, 2, 2, 1};
+
+/**
+ * Returns the number of pixels a pass has along one side of the image
+ * @param int pass is the pass from 0 to 6
+ * @param int size is the image width or height
+ * @param int* start is the start of the pass along that side (adam7_x_start or adam7_y_start)
+ * @param int* step is the step of the pass along that side (adam7_x_step or adam7_y_step)
+ * @return the number of pixels, 0 if the pass is empty
+*/
+int adam7_pass_size(int pass, int size, int* start, int* step) {
+    if (size <= start[pass]) return 0;
+    return (size - start[pass] + step[pass] - 1) / step[pass];
+}
+
+//Scatters one pass scanline of B byte pixels into an image row.  B is known at compile time so each copy is a
+//single fixed width store instead of a memcpy call.  rep copies each pixel across its block for a blocky preview
+#define DEFINE_SCATTER(B) \
+void scatter_##B(uint8_t* dst, uint8_t* src, int count, int x_start, int x_step, int rep, int width) { \
+    uint8_t* out = dst + (size_t) x_start * B; \
+    if (rep == 1) { \
+        for (int i = 0; i < count; i++, out += (size_t) x_step * B, src += B) memcpy(out, src, B); \
+        return; \
+    } \
+    for (int i = 0; i < count; i++, out += (size_t) x_step * B, src += B) { \
+        int n = width - x_start - i * x_step < rep ? width - x_start - i * x_step : rep; \
+        for (int k = 0; k < n; k++) memcpy(out + k * B, src, B); \
+    } \
+}
+
+DEFINE_SCATTER(1)
+DEFINE_SCATTER(2)
+DEFINE_SCATTER(3)
+DEFINE_SCATTER(4)
+DEFINE_SCATTER(6)
+DEFINE_SCATTER(8)
+
+/**
+ * Scatters one pass scanline of pixels below 8 bits into an image row
+ * @param uint8_t* dst is the image row
+ * @param uint8_t* src is the unfiltered pass scanline
+ * @param int count is the number of pixels in the pass scanline
+ * @param int x_start is the image column of the first pixel
+ * @param int x_step is the number of image columns between pixels
+ * @param int rep is the number of image columns each pixel is written to
+ * @param int width is the image width
+ * @param int bits is the bits per pixel (1, 2 or 4)
+*/
+void scatter_bits(uint8_t* dst, uint8_t* src, int count, int x_start, int x_step, int rep, int width, int bits) {
+    uint8_t mask = (1 << bits) - 1;
+    for (int i = 0; i < count; i++) {
+        uint8_t sample = get_sample(src, i, bits);
+        int x = x_start + i * x_step;
+        int n = width - x < rep ? width - x : rep;
+        for (int k = 0; k < n; k++) {
+            int bit = (x + k) * bits;
+            int shift = 8 - bits - bit % 8;
+            dst[bit / 8] = (dst[bit / 8] & ~(mask << shift)) | (sample << shift);
+        }
+    }
+}
+
+/**
+ * Writes one unfiltered pass scanline into its place in the full image
+ * @param uint8_t* image is the full image of unfiltered scanlines
+ * @param size_t row_len is the number of bytes in a full image scanline
+ * @param int width is the image width
+ * @param int height is the image height
+ * @param int bits is the bits per pixel
+ * @param int pass is the pass from 0 to 6
+ * @param int pass_y is the scanline within the pass
+ * @param uint8_t* src is the unfiltered pass scanline
+ * @param int pass_width is the number of pixels in the pass scanline
+ * @param int fill_blocks is true to also write each pixel over the block it stands in for until later passes
+*/
+void scatter_pass_row(uint8_t* image, size_t row_len, int width, int height, int bits, int pass, int pass_y, uint8_t* src, int pass_width, int fill_blocks) {
+    int y = adam7_y_start[pass] + pass_y * adam7_y_step[pass];
+    int rep = fill_blocks ? adam7_block_width[pass] : 1;
+    int rows = fill_blocks ? adam7_block_height[pass] : 1;
+    if (y + rows > height) rows = height - y;
+
+    for (int r = 0; r < rows; r++) {
+        uint8_t* dst = image + (size_t) (y + r) * row_len;
+        int x_start = adam7_x_start[pass];
+        int x_step = adam7_x_step[pass];
+        switch (bits) {
+            case 8: scatter_1(dst, src, pass_width, x_start, x_step, rep, width); break;
+            case 16: scatter_2(dst, src, pass_width, x_start, x_step, rep, width); break;
+            case 24: scatter_3(dst, src, pass_width, x_start, x_step, rep, width); break;
+            case 32: scatter_4(dst, src, pass_width, x_start, x_step, rep, width); break;
+            case 48: scatter_6(dst, src, pass_width, x_start, x_step, rep, width); break;
+            case 64: scatter_8(dst, src, pass_width, x_start, x_step, rep, width); break;
+            default: scatter_bits(dst, src, pass_width, x_start, x_step, rep, width, bits); break;
+        }
+    }
+}
@@ -0,0 +1,15 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#define ADAM7_PASSES 7
+
+extern int adam7_x_start[ADAM7_PASSES];
+extern int adam7_y_start[ADAM7_PASSES];
+extern int adam7_x_step[ADAM7_PASSES];
+extern int adam7_y_step[ADAM7_PASSES];
+extern int adam7_block_width[ADAM7_PASSES];
+extern int adam7_block_height[ADAM7_PASSES];
+
+int adam7_pass_size(int pass, int size, int* start, int* step);
+
+void scatter_pass_row(uint8_t* image, size_t row_len, int width, int height, int bits, int pass, int pass_y, uint8_t* src, int pass_width, int fill_blocks);
@@ -1,8 +1,29 @@
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <malloc.h>
 #include <errno.h>
+#ifdef _WIN32
 #include <winsock.h>
+#else
+#include <arpa/inet.h>
+#endif
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "huffman.h"
+#include "deflate.h"
+#include "inflate.h"
+#include "filter.h"
+#include "png.h"
+#include "checksum.h"
+#include "pool.h"
+#include "spsc.h"
+#include "convert.h"
+#include "interlace.h"
+#include "cpu.h"
 
 //Used for each chunk of PNG 
 //As defined here: https://en.wikipedia.org/wiki/PNG#File_format
@@ -13,6 +34,78 @@ struct Chunk {
     unsigned int crc;
 };
 
+//A batch of scanlines passed between the read_PNG_pipelined threads
+struct RowBatch {
+    unsigned int first_row;
+    unsigned int num_rows;
+    int last;       //true for the batch holding the last scanline
+    uint8_t* rows;  //num_rows scanlines each with its filter type byte in front
+};
+
+//Shared state of the read_PNG_pipelined threads.  Batches go round free -> inflated -> unfiltered -> free
+struct Pipeline {
+    struct IHDR ihdr;
+    struct ColorInfo color;
+    size_t row_len;
+    int bpp;
+    int (*unfilter)(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp);   //kernel picked for this pixel size
+    struct RowBatch batches[PIPELINE_BATCHES];
+    struct SPSCQueue free_batches;  //converter to inflater
+    struct SPSCQueue inflated;      //inflater to unfilterer
+    struct SPSCQueue unfiltered;    //unfilterer to converter
+    atomic_int stop;
+    atomic_int error;
+    int (*pixel_callback)(void* user, int y, uint8_t* rgba, int width);
+    void* user;
+};
+
+//Where read_PNG_rows sends the scanlines from inflate_rows
+struct RowTarget {
+    int (*row_callback)(void* user, int y, uint8_t* row, size_t row_len);
+    void* user;
+    size_t row_len;
+};
+
+//Where inflate_image puts the scanlines from inflate_rows
+struct ImageTarget {
+    struct IHDR* ihdr;
+    int bits;
+    size_t row_len;
+    int fill_blocks;
+    int (*pass_callback)(void* user, int pass, uint8_t* image, size_t row_len);
+    void* user;
+    uint8_t* image;
+};
+
+//State of read_PNG_thumbnail while scanlines come out of inflate_rows.  Only thumbnail sized buffers
+struct Thumbnail {
+    struct IHDR* ihdr;
+    struct ColorInfo color;
+    int width;
+    int height;
+    int* col_start;     //width + 1 entries, the first image column of each thumbnail column
+    int* row_start;     //height + 1 entries, the first image row of each thumbnail row
+    uint64_t* sums;     //premultiplied RGBA sums of each thumbnail pixel.  One thumbnail row unless interlaced
+    uint8_t* rgba;      //one image scanline converted to RGBA
+    uint8_t* pixels;    //the thumbnail as RGBA
+};
+
+//One filter strategy tried by write_PNG_max
+struct FilterTrial {
+    uint8_t* compressed;
+    size_t compressed_len;
+};
+
+//Shared input for the filter trials of write_PNG_max
+struct FilterTrials {
+    uint8_t* pixels;
+    int height;
+    int row_len;
+    int bpp;
+    int iterations;
+    struct FilterTrial trials[NUM_FILTER_STRATEGIES];
+};
+
 /**
  * Checks first 8 bytes to see if it matches a PNG signature
  * Expected to see 89 50 4E 47 0D 0A 1A 0A
@@ -141,23 +234,872 @@ int read_PNG(char* filepath){
     return 0;
 }
 
-int main() {
-    char* filepath = "test";
-    char* imgpath = "DankChungus.png";
-    char buf[1024];
-    FILE *testp = fopen(filepath, "rb");
+/**
+ * Reads the length and type of the next chunk
+ * @param FILE* fp is the PNG file at the start of a chunk
+ * @param unsigned int* len is set to the length of the chunk data
+ * @param char chunk_type[4] is set to the chunk type
+ * @return -1 if error occurs 0 otherwise
+*/
+int read_chunk_header(FILE* fp, unsigned int* len, char chunk_type[4]) {
+    if (fread(len, 4, 1, fp) != 1 || fread(chunk_type, 4, 1, fp) != 1) {
+        fprintf(stderr, "INVALID READ ON CHUNK HEADER\n");
+        return -1;
+    }
+    *len = ntohl(*len);
+    if (*len > 0x7fffffff) {
+        fprintf(stderr, "CHUNK %.4s IS TOO LONG\n", chunk_type);
+        return -1;
+    }
+    return 0;
+}
 
-    int read = fread(buf, 1, 1024, testp);
+/**
+ * Reads the CRC at the end of a chunk and checks it
+ * @param FILE* fp is the PNG file at the end of a chunk's data
+ * @param uint32_t crc is the CRC of the chunk type and data
+ * @param char* chunk_type is the chunk type for the error message
+ * @return -1 if error occurs or the CRC does not match 0 otherwise
+*/
+int check_chunk_crc(FILE* fp, uint32_t crc, char* chunk_type) {
+    unsigned int stored;
+    if (fread(&stored, 4, 1, fp) != 1) {
+        fprintf(stderr, "INVALID READ ON CHUNK %.4s CRC\n", chunk_type);
+        return -1;
+    }
+    if (ntohl(stored) != crc) {
+        fprintf(stderr, "CRC MISMATCH ON CHUNK %.4s\n", chunk_type);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads and checks the IHDR chunk data
+ * @param uint8_t* data is the IHDR chunk data
+ * @param unsigned int len is the length of the chunk data
+ * @param struct IHDR* ihdr is set to the image header
+ * @return -1 if the header is invalid 0 otherwise
+*/
+int parse_IHDR(uint8_t* data, unsigned int len, struct IHDR* ihdr) {
+    if (len != 13) {
+        fprintf(stderr, "INVALID IHDR LENGTH\n");
+        return -1;
+    }
+    unsigned int width;
+    unsigned int height;
+    memcpy(&width, data, 4);
+    memcpy(&height, data + 4, 4);
+    ihdr->width = ntohl(width);
+    ihdr->height = ntohl(height);
+    ihdr->bit_depth = data[8];
+    ihdr->color_type = data[9];
+    ihdr->compression = data[10];
+    ihdr->filter = data[11];
+    ihdr->interlace = data[12];
+
+    if (!ihdr->width || !ihdr->height || ihdr->width > 0x7fffffff || ihdr->height > 0x7fffffff) {
+        fprintf(stderr, "INVALID IMAGE SIZE\n");
+        return -1;
+    }
+    if (bits_per_pixel(ihdr->color_type, ihdr->bit_depth) < 0) {
+        fprintf(stderr, "INVALID COLOR TYPE AND BIT DEPTH\n");
+        return -1;
+    }
+    if (ihdr->compression || ihdr->filter || ihdr->interlace > 1) {
+        fprintf(stderr, "INVALID COMPRESSION, FILTER OR INTERLACE METHOD\n");
+        return -1;
+    }
+    return 0;
+}
 
-    // sample read
-    // for(int i = 0; i<read; i++){    
-    //     printf("%c\n", buf[i]);
-    // }
+/**
+ * Opens a PNG and reads every chunk before the first IDAT.  Only IHDR, PLTE and tRNS are kept
+ * @param char* filepath is the PNG file's path
+ * @param struct PNGStream* stream is set up to read the IDAT data
+ * @return -1 if error occurs 0 otherwise
+*/
+int open_png_stream(char* filepath, struct PNGStream* stream) {
+    init_cpu_dispatch();
+    memset(stream, 0, offsetof(struct PNGStream, buf));
+    stream->fp = fopen(filepath, "rb");
+    if (stream->fp == NULL) {
+        fprintf(stderr, "COULD NOT OPEN %s\n", filepath);
+        return -1;
+    }
 
-    printf("Image Below\n");
+    //Break if file does not have PNG signature
+    if (!check_signature(stream->fp)) {
+        fprintf(stderr, "INVALID SIG\n");
+        return -1;
+    }
 
-    read_PNG(imgpath);
+    int seen_IHDR = 0;
+    while (1) {
+        unsigned int len;
+        char chunk_type[4];
+        if (read_chunk_header(stream->fp, &len, chunk_type)) return -1;
+
+        if (!seen_IHDR && memcmp(chunk_type, "IHDR", 4)) {
+            fprintf(stderr, "IHDR IS NOT THE FIRST CHUNK\n");
+            return -1;
+        }
+
+        if (!memcmp(chunk_type, "IDAT", 4)) {
+            stream->chunk_left = len;
+            stream->crc = crc32_update(0, (uint8_t*) chunk_type, 4);
+            return 0;
+        } else if (!memcmp(chunk_type, "IEND", 4)) {
+            fprintf(stderr, "NO IDAT CHUNK\n");
+            return -1;
+        } else if (!memcmp(chunk_type, "IHDR", 4) || !memcmp(chunk_type, "PLTE", 4) || !memcmp(chunk_type, "tRNS", 4)) {
+            uint8_t data[768];
+            if (len > sizeof(data) || fread(data, 1, len, stream->fp) != len) {
+                fprintf(stderr, "INVALID READ ON CHUNK %.4s DATA\n", chunk_type);
+                return -1;
+            }
+            uint32_t crc = crc32_update(crc32_update(0, (uint8_t*) chunk_type, 4), data, len);
+            if (check_chunk_crc(stream->fp, crc, chunk_type)) return -1;
+
+            if (chunk_type[0] == 'I') {
+                if (seen_IHDR || parse_IHDR(data, len, &stream->ihdr)) return -1;
+                seen_IHDR = 1;
+            } else if (chunk_type[0] == 'P') {
+                memcpy(stream->palette, data, len);
+                stream->palette_len = len;
+            } else if (len <= sizeof(stream->trns)) {
+                memcpy(stream->trns, data, len);
+                stream->trns_len = len;
+            }
+        } else { //skip the data and CRC of every other chunk
+            if (fseek(stream->fp, (long) len + 4, SEEK_CUR)) {
+                fprintf(stderr, "INVALID READ ON CHUNK %.4s DATA\n", chunk_type);
+                return -1;
+            }
+        }
+    }
+}
+
+/**
+ * Refill for an InflateStream that reads the IDAT chunks IDAT_BUFFER_SIZE bytes at a time, checking the CRC of each
+ * @param void* ctx is the struct PNGStream*
+ * @param uint8_t** buf is set to the next compressed bytes
+ * @param size_t* len is set to the number of compressed bytes
+ * @return 0 when there are no more IDAT chunks or an error occurs 1 otherwise
+*/
+int refill_IDAT(void* ctx, uint8_t** buf, size_t* len) {
+    struct PNGStream* stream = ctx;
+    while (stream->chunk_left == 0) {
+        if (stream->idat_done) return 0;
+
+        //end of this IDAT so check it and look at the next chunk
+        unsigned int chunk_len;
+        char chunk_type[4];
+        if (check_chunk_crc(stream->fp, stream->crc, "IDAT") || read_chunk_header(stream->fp, &chunk_len, chunk_type)) {
+            stream->idat_done = 1;
+            stream->error = 1;
+            return 0;
+        }
+        if (memcmp(chunk_type, "IDAT", 4)) {
+            stream->idat_done = 1;
+            return 0;
+        }
+        stream->chunk_left = chunk_len;
+        stream->crc = crc32_update(0, (uint8_t*) chunk_type, 4);
+    }
+
+    size_t n = stream->chunk_left < IDAT_BUFFER_SIZE ? stream->chunk_left : IDAT_BUFFER_SIZE;
+    if (fread(stream->buf, 1, n, stream->fp) != n) {
+        fprintf(stderr, "INVALID READ ON CHUNK IDAT DATA\n");
+        stream->idat_done = 1;
+        stream->error = 1;
+        return 0;
+    }
+    stream->crc = crc32_update(stream->crc, stream->buf, n);
+    stream->chunk_left -= n;
+    *buf = stream->buf;
+    *len = n;
     return 1;
 }
 
+/**
+ * Closes the PNG file of a stream
+ * @param struct PNGStream* stream is the stream to close
+*/
+void close_png_stream(struct PNGStream* stream) {
+    if (stream->fp) fclose(stream->fp);
+    stream->fp = NULL;
+}
+
+/**
+ * inflate_rows callback for read_PNG_rows.  Hands the scanline on without its pass
+ * @param void* user is the struct RowTarget*
+ * @param int pass is the pass, always the last since the image is not interlaced
+ * @param int y is the row
+ * @param uint8_t* row is the unfiltered scanline
+ * @param int width is the number of pixels in the scanline
+ * @return nonzero to stop decoding
+*/
+int rows_row(void* user, int pass, int y, uint8_t* row, int width) {
+    struct RowTarget* target = user;
+    (void) pass;
+    (void) width;
+    return target->row_callback(target->user, y, row, target->row_len);
+}
+
+/**
+ * Decodes a non interlaced PNG one scanline at a time with inflate_rows.  Only the inflate window, the previous and
+ * current scanline and one IDAT buffer are held so memory does not depend on the image height.
+ * Interlaced images are refused since their scanlines do not come in image order.  Use inflate_rows on a PNGStream
+ * to get their passes a scanline at a time
+ * @param char* filepath is the PNG file's path
+ * @param struct IHDR* ihdr is set to the image header before the first scanline is handed over
+ * @param int (*row_callback)(void* user, int y, uint8_t* row, size_t row_len) is given each unfiltered scanline
+ * in order.  row is only valid during the call.  Return nonzero to stop decoding
+ * @param void* user is passed to row_callback
+ * @param struct InflateStats* stats is set to the counters of the decode.  May be NULL
+ * @return -1 if error occurs or the image is interlaced 0 otherwise
+*/
+int read_PNG_rows(char* filepath, struct IHDR* ihdr, int (*row_callback)(void* user, int y, uint8_t* row, size_t row_len), void* user,
+                  struct InflateStats* stats) {
+    if (stats) memset(stats, 0, sizeof(struct InflateStats));
+    struct PNGStream* stream = malloc(sizeof(struct PNGStream));
+    if (open_png_stream(filepath, stream)) {
+        close_png_stream(stream);
+        free(stream);
+        return -1;
+    }
+    *ihdr = stream->ihdr;
+    if (ihdr->interlace) {
+        fprintf(stderr, "INTERLACED IMAGES ARE NOT SUPPORTED\n");
+        close_png_stream(stream);
+        free(stream);
+        return -1;
+    }
+
+    struct RowTarget target;
+    target.row_callback = row_callback;
+    target.user = user;
+    target.row_len = scanline_bytes(ihdr->width, bits_per_pixel(ihdr->color_type, ihdr->bit_depth));
+
+    struct InflateStream* inflate = malloc(sizeof(struct InflateStream));
+    inflate_init(inflate, refill_IDAT, stream);
+    int result = inflate_rows(inflate, ihdr, rows_row, NULL, &target) < 0 ? -1 : 0;
+
+    add_inflate_stats(inflate, stats);
+    inflate_end(inflate);
+    free(inflate);
+    close_png_stream(stream);
+    free(stream);
+    return result;
+}
+
+/**
+ * Tells every pipeline thread to finish and wakes any that are sleeping on a queue
+ * @param struct Pipeline* pipe is the pipeline
+ * @param int error is true if decoding failed, false if the callback asked to stop
+*/
+void stop_pipeline(struct Pipeline* pipe, int error) {
+    if (error) atomic_store(&pipe->error, 1);
+    atomic_store(&pipe->stop, 1);
+    spsc_wake(&pipe->free_batches);
+    spsc_wake(&pipe->inflated);
+    spsc_wake(&pipe->unfiltered);
+}
+
+/**
+ * Second pipeline stage.  Unfilters each inflated batch, keeping a copy of the last scanline for the next batch
+ * @param void* arg is the struct Pipeline*
+ * @return NULL
+*/
+void* unfilter_stage(void* arg) {
+    struct Pipeline* pipe = arg;
+    size_t stride = pipe->row_len + 1;
+    uint8_t* prev = calloc(pipe->row_len, 1);
+
+    struct RowBatch* batch;
+    while ((batch = spsc_pop_wait(&pipe->inflated, &pipe->stop)) != NULL) {
+        for (unsigned int i = 0; i < batch->num_rows; i++) {
+            uint8_t* row = batch->rows + i * stride;
+            uint8_t* above = i ? row - stride + 1 : prev;
+            if (pipe->unfilter(row[0], row + 1, above, pipe->row_len, pipe->bpp)) {
+                fprintf(stderr, "INVALID FILTER TYPE %d ON ROW %u\n", row[0], batch->first_row + i);
+                stop_pipeline(pipe, 1);
+                break;
+            }
+        }
+        if (atomic_load(&pipe->stop)) break;
+
+        memcpy(prev, batch->rows + (batch->num_rows - 1) * stride + 1, pipe->row_len);
+        int last = batch->last;
+        spsc_push(&pipe->unfiltered, batch);
+        if (last) break;
+    }
+
+    free(prev);
+    return NULL;
+}
+
+/**
+ * Third pipeline stage.  Converts each unfiltered scanline to 8 bit RGBA, hands it to the callback and recycles the batch
+ * @param void* arg is the struct Pipeline*
+ * @return NULL
+*/
+void* convert_stage(void* arg) {
+    struct Pipeline* pipe = arg;
+    size_t stride = pipe->row_len + 1;
+    uint8_t* rgba = malloc((size_t) pipe->ihdr.width * 4);
+
+    struct RowBatch* batch;
+    while ((batch = spsc_pop_wait(&pipe->unfiltered, &pipe->stop)) != NULL) {
+        for (unsigned int i = 0; i < batch->num_rows; i++) {
+            pipe->color.convert(&pipe->color, batch->rows + i * stride + 1, pipe->ihdr.width, rgba);
+            if (pipe->pixel_callback(pipe->user, batch->first_row + i, rgba, pipe->ihdr.width)) {
+                stop_pipeline(pipe, 0);
+                break;
+            }
+        }
+        if (atomic_load(&pipe->stop)) break;
 
+        int last = batch->last;
+        spsc_push(&pipe->free_batches, batch);
+        if (last) break;
+    }
+
+    free(rgba);
+    return NULL;
+}
+
+/**
+ * Decodes a non interlaced PNG to 8 bit RGBA on three threads: the calling thread inflates into batches of scanlines,
+ * a second thread unfilters them and a third converts them and hands each scanline to the callback.
+ * Batches are handed over with lock-free queues, and a thread waiting on a slower stage sleeps after a short spin.
+ * Memory is bounded by PIPELINE_BATCHES batches, not the image height.  Interlaced images are refused since their
+ * scanlines do not come in image order.  Use read_PNG_image for them
+ * @param char* filepath is the PNG file's path
+ * @param struct IHDR* ihdr is set to the image header before the first scanline is handed over
+ * @param int (*pixel_callback)(void* user, int y, uint8_t* rgba, int width) is given each converted scanline in order
+ * from the converter thread.  rgba is only valid during the call.  Return nonzero to stop decoding
+ * @param void* user is passed to pixel_callback
+ * @param struct InflateStats* stats is set to the counters of the decode.  May be NULL
+ * @return -1 if error occurs or the image is interlaced 0 otherwise
+*/
+int read_PNG_pipelined(char* filepath, struct IHDR* ihdr, int (*pixel_callback)(void* user, int y, uint8_t* rgba, int width), void* user,
+                       struct InflateStats* stats) {
+    if (stats) memset(stats, 0, sizeof(struct InflateStats));
+    struct PNGStream* stream = malloc(sizeof(struct PNGStream));
+    if (open_png_stream(filepath, stream)) {
+        close_png_stream(stream);
+        free(stream);
+        return -1;
+    }
+    *ihdr = stream->ihdr;
+    if (ihdr->interlace) {
+        fprintf(stderr, "INTERLACED IMAGES ARE NOT SUPPORTED\n");
+        close_png_stream(stream);
+        free(stream);
+        return -1;
+    }
+
+    struct Pipeline* pipe = malloc(sizeof(struct Pipeline));
+    int bits = bits_per_pixel(ihdr->color_type, ihdr->bit_depth);
+    pipe->ihdr = *ihdr;
+    pipe->row_len = scanline_bytes(ihdr->width, bits);
+    pipe->bpp = bits >= 8 ? bits / 8 : 1;
+    pipe->unfilter = row_unfilterer(ihdr->color_type, ihdr->bit_depth);
+    pipe->pixel_callback = pixel_callback;
+    pipe->user = user;
+    atomic_init(&pipe->stop, 0);
+    atomic_init(&pipe->error, 0);
+    init_color_info(&pipe->color, ihdr->color_type, ihdr->bit_depth, stream->palette, stream->palette_len,
+                    stream->trns_len ? stream->trns : NULL, stream->trns_len);
+
+    //every queue can hold every batch so pushes never fail
+    spsc_init(&pipe->free_batches, PIPELINE_BATCHES);
+    spsc_init(&pipe->inflated, PIPELINE_BATCHES);
+    spsc_init(&pipe->unfiltered, PIPELINE_BATCHES);
+    size_t stride = pipe->row_len + 1;
+    for (int i = 0; i < PIPELINE_BATCHES; i++) {
+        pipe->batches[i].rows = malloc(stride * PIPELINE_BATCH_ROWS);
+        spsc_push(&pipe->free_batches, &pipe->batches[i]);
+    }
+
+    pthread_t unfilter_thread;
+    pthread_t convert_thread;
+    int result = 0;
+    if (pthread_create(&unfilter_thread, NULL, unfilter_stage, pipe) != 0) {
+        fprintf(stderr, "COULD NOT START PIPELINE THREADS\n");
+        result = -1;
+    } else if (pthread_create(&convert_thread, NULL, convert_stage, pipe) != 0) {
+        fprintf(stderr, "COULD NOT START PIPELINE THREADS\n");
+        stop_pipeline(pipe, 0);
+        pthread_join(unfilter_thread, NULL);
+        result = -1;
+    }
+
+    if (!result) {
+        //first stage runs on this thread since it owns the file
+        struct InflateStream* inflate = malloc(sizeof(struct InflateStream));
+        inflate_init(inflate, refill_IDAT, stream);
+
+        unsigned int y = 0;
+        struct RowBatch* batch;
+        while (y < ihdr->height && (batch = spsc_pop_wait(&pipe->free_batches, &pipe->stop)) != NULL) {
+            batch->first_row = y;
+            batch->num_rows = ihdr->height - y < PIPELINE_BATCH_ROWS ? ihdr->height - y : PIPELINE_BATCH_ROWS;
+            batch->last = y + batch->num_rows == ihdr->height;
+            size_t want = stride * batch->num_rows;
+            if (inflate_read(inflate, batch->rows, want) != want) {
+                fprintf(stderr, "NOT ENOUGH IMAGE DATA\n");
+                stop_pipeline(pipe, 1);
+                break;
+            }
+            y += batch->num_rows;
+            spsc_push(&pipe->inflated, batch);
+        }
+
+        pthread_join(unfilter_thread, NULL);
+        pthread_join(convert_thread, NULL);
+
+        //read to the end of the zlib stream so its Adler-32 is checked
+        if (!atomic_load(&pipe->stop)) {
+            uint8_t extra;
+            if (inflate_read(inflate, &extra, 1)) fprintf(stderr, "EXTRA IMAGE DATA IGNORED\n");
+            if (inflate->error) atomic_store(&pipe->error, 1);
+        }
+        add_inflate_stats(inflate, stats);
+        inflate_end(inflate);
+        free(inflate);
+        if (atomic_load(&pipe->error)) result = -1;
+    }
+
+    for (int i = 0; i < PIPELINE_BATCHES; i++) free(pipe->batches[i].rows);
+    spsc_free(&pipe->free_batches);
+    spsc_free(&pipe->inflated);
+    spsc_free(&pipe->unfiltered);
+    free(pipe);
+    close_png_stream(stream);
+    free(stream);
+    return result;
+}
+
+/**
+ * Inflates and unfilters every scanline of an image from a zlib stream, interlaced or not, handing each one over as
+ * soon as it is unfiltered.  An Adam7 image comes one pass at a time, each pass unfiltered as its own small image.
+ * Only two scanlines are held so memory does not depend on the image height
+ * @param struct InflateStream* inflate is the zlib stream of the image data
+ * @param struct IHDR* ihdr is the image header.  The width and height are those of the image in the stream
+ * @param int (*row_callback)(void* user, int pass, int y, uint8_t* row, int width) is given each unfiltered
+ * scanline, its pass from 0 to 6, its row within the pass and its number of pixels.  A non interlaced image is all
+ * pass 6.  row is only valid during the call.  Return nonzero to stop decoding
+ * @param int (*pass_callback)(void* user, int pass) is called after each pass.  Return nonzero to stop decoding.
+ * May be NULL
+ * @param void* user is passed to both callbacks
+ * @return -1 if error occurs, 1 if a callback stopped decoding 0 otherwise
+*/
+int inflate_rows(struct InflateStream* inflate, struct IHDR* ihdr, int (*row_callback)(void* user, int pass, int y, uint8_t* row, int width),
+                 int (*pass_callback)(void* user, int pass), void* user) {
+    int bits = bits_per_pixel(ihdr->color_type, ihdr->bit_depth);
+    size_t row_len = scanline_bytes(ihdr->width, bits);
+    int bpp = bits >= 8 ? bits / 8 : 1;
+    int (*unfilter)(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp) = row_unfilterer(ihdr->color_type, ihdr->bit_depth);
+
+    uint8_t* cur = malloc(row_len + 1);
+    uint8_t* prev = malloc(row_len + 1);
+
+    //a non interlaced image is one pass covering every pixel
+    int first_pass = ihdr->interlace ? 0 : ADAM7_PASSES - 1;
+    int stopped = 0;
+    for (int pass = first_pass; pass < ADAM7_PASSES && !stopped && !inflate->error; pass++) {
+        int pass_width = ihdr->width;
+        int pass_height = ihdr->height;
+        if (ihdr->interlace) {
+            pass_width = adam7_pass_size(pass, ihdr->width, adam7_x_start, adam7_x_step);
+            pass_height = adam7_pass_size(pass, ihdr->height, adam7_y_start, adam7_y_step);
+        }
+        //an empty pass has no scanlines at all, not even filter type bytes
+        if (pass_width == 0) pass_height = 0;
+        size_t pass_len = scanline_bytes(pass_width, bits);
+        memset(prev, 0, pass_len + 1);
+
+        for (int y = 0; y < pass_height && !stopped; y++) {
+            if (inflate_read(inflate, cur, pass_len + 1) != pass_len + 1) {
+                fprintf(stderr, "NOT ENOUGH IMAGE DATA\n");
+                inflate->error = 1;
+                break;
+            }
+            if (unfilter(cur[0], cur + 1, prev + 1, pass_len, bpp)) {
+                fprintf(stderr, "INVALID FILTER TYPE %d ON PASS %d ROW %d\n", cur[0], pass + 1, y);
+                inflate->error = 1;
+                break;
+            }
+            if (row_callback(user, pass, y, cur + 1, pass_width)) stopped = 1;
+
+            uint8_t* tmp = prev;
+            prev = cur;
+            cur = tmp;
+        }
+        if (!stopped && !inflate->error && pass_callback && pass_callback(user, pass)) stopped = 1;
+    }
+
+    //read to the end of the zlib stream so its Adler-32 is checked
+    if (!stopped && !inflate->error && inflate_read(inflate, cur, 1)) {
+        fprintf(stderr, "EXTRA IMAGE DATA IGNORED\n");
+    }
+    free(cur);
+    free(prev);
+    if (inflate->error) return -1;
+    return stopped;
+}
+
+/**
+ * inflate_rows callback for inflate_image.  Puts a scanline in its place in the whole image
+ * @param void* user is the struct ImageTarget*
+ * @param int pass is the pass from 0 to 6
+ * @param int y is the row within the pass
+ * @param uint8_t* row is the unfiltered scanline
+ * @param int width is the number of pixels in the scanline
+ * @return 0 to keep decoding
+*/
+int image_row(void* user, int pass, int y, uint8_t* row, int width) {
+    struct ImageTarget* target = user;
+    struct IHDR* ihdr = target->ihdr;
+    if (ihdr->interlace) {
+        scatter_pass_row(target->image, target->row_len, ihdr->width, ihdr->height, target->bits, pass, y, row, width, target->fill_blocks);
+    } else {
+        memcpy(target->image + (size_t) y * target->row_len, row, target->row_len);
+    }
+    return 0;
+}
+
+/**
+ * inflate_rows callback for inflate_image.  Shows the image so far to the caller's pass callback
+ * @param void* user is the struct ImageTarget*
+ * @param int pass is the pass from 0 to 6 that just finished
+ * @return nonzero to stop decoding
+*/
+int image_pass(void* user, int pass) {
+    struct ImageTarget* target = user;
+    return target->pass_callback && target->pass_callback(target->user, pass + 1, target->image, target->row_len);
+}
+
+/**
+ * Inflates and unfilters a whole image from a zlib stream into one buffer.  An Adam7 image is scattered into place a
+ * pass at a time so pass_callback can show a coarse image early and stop once it has enough detail without
+ * inflating the rest
+ * @param struct InflateStream* inflate is the zlib stream of the image data
+ * @param struct IHDR* ihdr is the image header.  The width and height are those of the image in the stream
+ * @param int fill_blocks is true to write each pass pixel over the whole block it stands in for so every pass
+ * leaves a complete blocky image instead of scattered pixels
+ * @param int (*pass_callback)(void* user, int pass, uint8_t* image, size_t row_len) is given the image after each
+ * pass 1 to 7.  A non interlaced image only has pass 7.  Return nonzero to stop decoding.  May be NULL
+ * @param void* user is passed to pass_callback
+ * @return the MALLOCED image as height scanlines of row_len bytes with no filter type bytes, NULL if error occurs.
+ * Passes after a stop are left as zeros, or as the blocks of earlier passes with fill_blocks
+*/
+uint8_t* inflate_image(struct InflateStream* inflate, struct IHDR* ihdr, int fill_blocks, int (*pass_callback)(void* user, int pass, uint8_t* image, size_t row_len), void* user) {
+    struct ImageTarget target;
+    target.ihdr = ihdr;
+    target.bits = bits_per_pixel(ihdr->color_type, ihdr->bit_depth);
+    target.row_len = scanline_bytes(ihdr->width, target.bits);
+    target.fill_blocks = fill_blocks;
+    target.pass_callback = pass_callback;
+    target.user = user;
+    target.image = calloc((size_t) ihdr->height * target.row_len, 1);
+    if (target.image == NULL) {
+        fprintf(stderr, "IMAGE TOO LARGE\n");
+        return NULL;
+    }
+
+    if (inflate_rows(inflate, ihdr, image_row, image_pass, &target) < 0) {
+        free(target.image);
+        return NULL;
+    }
+    return target.image;
+}
+
+/**
+ * Decodes a whole PNG into its unfiltered scanlines with inflate_image, reading only up to the end of the IDAT chunks
+ * @param char* filepath is the PNG file's path
+ * @param struct IHDR* ihdr is set to the image header
+ * @param int fill_blocks is passed to inflate_image
+ * @param int (*pass_callback)(void* user, int pass, uint8_t* image, size_t row_len) is passed to inflate_image
+ * @param void* user is passed to pass_callback
+ * @param struct InflateStats* stats is set to the counters of the decode.  May be NULL
+ * @return the MALLOCED image as height scanlines of row_len bytes with no filter type bytes, NULL if error occurs
+*/
+uint8_t* read_PNG_image(char* filepath, struct IHDR* ihdr, int fill_blocks, int (*pass_callback)(void* user, int pass, uint8_t* image, size_t row_len), void* user,
+                        struct InflateStats* stats) {
+    if (stats) memset(stats, 0, sizeof(struct InflateStats));
+    struct PNGStream* stream = malloc(sizeof(struct PNGStream));
+    uint8_t* image = NULL;
+    if (!open_png_stream(filepath, stream)) {
+        *ihdr = stream->ihdr;
+        struct InflateStream* inflate = malloc(sizeof(struct InflateStream));
+        inflate_init(inflate, refill_IDAT, stream);
+        image = inflate_image(inflate, ihdr, fill_blocks, pass_callback, user);
+        add_inflate_stats(inflate, stats);
+        inflate_end(inflate);
+        free(inflate);
+    }
+    close_png_stream(stream);
+    free(stream);
+    return image;
+}
+
+/**
+ * Averages the premultiplied sums of a thumbnail row into its RGBA pixels
+ * @param struct Thumbnail* thumb is the thumbnail
+ * @param int ty is the thumbnail row
+ * @param uint64_t* sums is the sums of the row's pixels
+*/
+void finish_thumbnail_row(struct Thumbnail* thumb, int ty, uint64_t* sums) {
+    uint8_t* out = thumb->pixels + (size_t) ty * thumb->width * 4;
+    uint64_t rows = thumb->row_start[ty + 1] - thumb->row_start[ty];
+    for (int tx = 0; tx < thumb->width; tx++, sums += 4, out += 4) {
+        uint64_t count = rows * (thumb->col_start[tx + 1] - thumb->col_start[tx]);
+        uint64_t alpha = sums[3];
+        //colors are summed times alpha so dividing by the alpha sum undoes it and ignores transparent pixels
+        for (int c = 0; c < 3; c++) out[c] = alpha ? (sums[c] + alpha / 2) / alpha : 0;
+        out[3] = (alpha + count / 2) / count;
+    }
+}
+
+/**
+ * inflate_rows callback for read_PNG_thumbnail.  Converts a scanline to RGBA and adds it to the thumbnail pixels it
+ * covers, finishing a thumbnail row as soon as its last scanline is in
+ * @param void* user is the struct Thumbnail*
+ * @param int pass is the pass from 0 to 6
+ * @param int y is the row within the pass
+ * @param uint8_t* row is the unfiltered scanline
+ * @param int width is the number of pixels in the scanline
+ * @return 0 to keep decoding
+*/
+int thumbnail_row(void* user, int pass, int y, uint8_t* row, int width) {
+    struct Thumbnail* thumb = user;
+    struct IHDR* ihdr = thumb->ihdr;
+    thumb->color.convert(&thumb->color, row, width, thumb->rgba);
+
+    if (ihdr->interlace) {
+        //pass pixels are spread out over the image so each one is added on its own
+        int image_y = adam7_y_start[pass] + y * adam7_y_step[pass];
+        int ty = (uint64_t) image_y * thumb->height / ihdr->height;
+        uint64_t* sums = thumb->sums + (size_t) ty * thumb->width * 4;
+        uint8_t* px = thumb->rgba;
+        for (int i = 0; i < width; i++, px += 4) {
+            int image_x = adam7_x_start[pass] + i * adam7_x_step[pass];
+            uint64_t* sum = sums + (size_t) ((uint64_t) image_x * thumb->width / ihdr->width) * 4;
+            sum[0] += px[0] * px[3];
+            sum[1] += px[1] * px[3];
+            sum[2] += px[2] * px[3];
+            sum[3] += px[3];
+        }
+        return 0;
+    }
+
+    //scanlines come in order so only the thumbnail row being filled is kept
+    for (int tx = 0; tx < thumb->width; tx++) {
+        sum_premultiplied(thumb->rgba + (size_t) thumb->col_start[tx] * 4, thumb->col_start[tx + 1] - thumb->col_start[tx], thumb->sums + tx * 4);
+    }
+    int ty = (uint64_t) y * thumb->height / ihdr->height;
+    if (y + 1 == thumb->row_start[ty + 1]) {
+        finish_thumbnail_row(thumb, ty, thumb->sums);
+        memset(thumb->sums, 0, (size_t) thumb->width * 4 * sizeof(uint64_t));
+    }
+    return 0;
+}
+
+/**
+ * Decodes a PNG straight into a smaller RGBA thumbnail.  Each thumbnail pixel is the average of the box of image
+ * pixels it covers, weighted by alpha, added up as scanlines come out of unfiltering so the full size image is
+ * never held in memory
+ * @param char* filepath is the PNG file's path
+ * @param struct IHDR* ihdr is set to the image header
+ * @param int* thumb_width is the wanted thumbnail width.  Set to the width used, no more than the image width
+ * @param int* thumb_height is the wanted thumbnail height.  Set to the height used, no more than the image height
+ * @param struct InflateStats* stats is set to the counters of the decode.  May be NULL
+ * @return the MALLOCED thumbnail as thumb_height rows of thumb_width RGBA pixels, NULL if error occurs
+*/
+uint8_t* read_PNG_thumbnail(char* filepath, struct IHDR* ihdr, int* thumb_width, int* thumb_height, struct InflateStats* stats) {
+    if (stats) memset(stats, 0, sizeof(struct InflateStats));
+    if (*thumb_width < 1 || *thumb_height < 1) {
+        fprintf(stderr, "INVALID THUMBNAIL SIZE\n");
+        return NULL;
+    }
+    struct PNGStream* stream = malloc(sizeof(struct PNGStream));
+    if (open_png_stream(filepath, stream)) {
+        close_png_stream(stream);
+        free(stream);
+        return NULL;
+    }
+    *ihdr = stream->ihdr;
+    //the wanted size is known to be positive so it compares with the header unsigned, and the header is no more than
+    //0x7fffffff so it fits in an int
+    if ((unsigned int) *thumb_width > ihdr->width) *thumb_width = (int) ihdr->width;
+    if ((unsigned int) *thumb_height > ihdr->height) *thumb_height = (int) ihdr->height;
+
+    struct Thumbnail thumb;
+    thumb.ihdr = ihdr;
+    thumb.width = *thumb_width;
+    thumb.height = *thumb_height;
+    init_color_info(&thumb.color, ihdr->color_type, ihdr->bit_depth, stream->palette, stream->palette_len,
+                    stream->trns_len ? stream->trns : NULL, stream->trns_len);
+    thumb.col_start = malloc((thumb.width + 1) * sizeof(int));
+    thumb.row_start = malloc((thumb.height + 1) * sizeof(int));
+    //image column x goes to thumbnail column x * width / image width, so each thumbnail column starts at the
+    //first x rounding to it
+    for (int tx = 0; tx <= thumb.width; tx++) thumb.col_start[tx] = ((uint64_t) tx * ihdr->width + thumb.width - 1) / thumb.width;
+    for (int ty = 0; ty <= thumb.height; ty++) thumb.row_start[ty] = ((uint64_t) ty * ihdr->height + thumb.height - 1) / thumb.height;
+    size_t sum_rows = ihdr->interlace ? thumb.height : 1;
+    thumb.sums = calloc(sum_rows * thumb.width * 4, sizeof(uint64_t));
+    thumb.rgba = malloc((size_t) ihdr->width * 4);
+    thumb.pixels = malloc((size_t) thumb.width * thumb.height * 4);
+
+    struct InflateStream* inflate = malloc(sizeof(struct InflateStream));
+    inflate_init(inflate, refill_IDAT, stream);
+    if (thumb.sums == NULL || thumb.rgba == NULL || thumb.pixels == NULL) {
+        fprintf(stderr, "IMAGE TOO LARGE\n");
+        free(thumb.pixels);
+        thumb.pixels = NULL;
+    } else if (inflate_rows(inflate, ihdr, thumbnail_row, NULL, &thumb) < 0) {
+        free(thumb.pixels);
+        thumb.pixels = NULL;
+    } else if (ihdr->interlace) {
+        for (int ty = 0; ty < thumb.height; ty++) finish_thumbnail_row(&thumb, ty, thumb.sums + (size_t) ty * thumb.width * 4);
+    }
+    add_inflate_stats(inflate, stats);
+    inflate_end(inflate);
+    free(inflate);
+
+    free(thumb.col_start);
+    free(thumb.row_start);
+    free(thumb.sums);
+    free(thumb.rgba);
+    close_png_stream(stream);
+    free(stream);
+    return thumb.pixels;
+}
+
+/**
+ * Writes one chunk with its length and CRC
+ * @param FILE* fp is the PNG file
+ * @param char* chunk_type is the 4 letter chunk type
+ * @param uint8_t* data is the chunk data
+ * @param unsigned int len is the length of the chunk data
+ * @return -1 if error occurs 0 otherwise
+*/
+int write_chunk(FILE* fp, char* chunk_type, uint8_t* data, unsigned int len) {
+    unsigned int len_be = htonl(len);
+    uint32_t crc = crc32_update(0, (uint8_t*) chunk_type, 4);
+    crc = crc32_update(crc, data, len);
+    unsigned int crc_be = htonl(crc);
+
+    if (fwrite(&len_be, 4, 1, fp) != 1 || fwrite(chunk_type, 4, 1, fp) != 1
+        || (len && fwrite(data, len, 1, fp) != 1) || fwrite(&crc_be, 4, 1, fp) != 1) {
+        fprintf(stderr, "FAILED TO WRITE CHUNK %.4s\n", chunk_type);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Job for run_jobs that filters the image with one strategy and compresses it
+ * @param void* ctx is the struct FilterTrials*
+ * @param int index is the filter strategy to try
+*/
+void filter_trial_job(void* ctx, int index) {
+    struct FilterTrials* trials = ctx;
+    uint8_t* filtered = filter_image(trials->pixels, trials->height, trials->row_len, trials->bpp, index);
+    size_t filtered_len = (size_t) trials->height * (trials->row_len + 1);
+
+    trials->trials[index].compressed = zlib_compress_max(filtered, filtered_len, &trials->trials[index].compressed_len, trials->iterations, 1);
+    free(filtered);
+}
+
+/**
+ * Writes a non interlaced PNG as small as possible.  Every filter strategy is compressed with the maximum effort
+ * Deflate encoder, one strategy per thread, and the smallest is kept
+ * @param char* filepath is the PNG file's path
+ * @param uint8_t* pixels is the unfiltered scanlines one after another
+ * @param int width is the image width in pixels
+ * @param int height is the image height in pixels
+ * @param uint8_t bit_depth is the IHDR bit depth
+ * @param uint8_t color_type is the IHDR color type
+ * @param uint8_t* palette is the PLTE chunk data or NULL.  Needed for color type 3, a suggested palette for color types 2
+ * and 6 and not allowed for the greyscale color types 0 and 4
+ * @param int palette_len is the length of the PLTE chunk data
+ * @param uint8_t* trns is the tRNS chunk data or NULL: one alpha per palette entry for color type 3, or the 2 byte
+ * grey or 6 byte RGB sample that is transparent for color types 0 and 2
+ * @param int trns_len is the length of the tRNS chunk data
+ * @param int iterations is the number of optimal parses to try per Deflate block.  15 is a good default
+ * @param int threads is the number of threads to use
+ * @return -1 if error occurs 0 otherwise
+*/
+int write_PNG_max(char* filepath, uint8_t* pixels, int width, int height, uint8_t bit_depth, uint8_t color_type,
+                  uint8_t* palette, int palette_len, uint8_t* trns, int trns_len, int iterations, int threads) {
+    init_cpu_dispatch();
+    int bits = bits_per_pixel(color_type, bit_depth);
+    if (bits < 0 || width <= 0 || height <= 0) {
+        fprintf(stderr, "INVALID IMAGE FORMAT\n");
+        return -1;
+    }
+    if (color_type == 3 && !palette) {
+        fprintf(stderr, "COLOR TYPE 3 NEEDS A PALETTE\n");
+        return -1;
+    }
+    if (palette && (color_type == 0 || color_type == 4 || palette_len < 3 || palette_len > 768 || palette_len % 3)) {
+        fprintf(stderr, "INVALID PLTE FOR COLOR TYPE %d\n", color_type);
+        return -1;
+    }
+    if (trns && (color_type == 4 || color_type == 6 || (color_type == 0 && trns_len != 2)
+                 || (color_type == 2 && trns_len != 6) || (color_type == 3 && trns_len > palette_len / 3))) {
+        fprintf(stderr, "INVALID tRNS FOR COLOR TYPE %d\n", color_type);
+        return -1;
+    }
+
+    struct FilterTrials trials;
+    trials.pixels = pixels;
+    trials.height = height;
+    trials.row_len = scanline_bytes(width, bits);
+    trials.bpp = bits >= 8 ? bits / 8 : 1;
+    trials.iterations = iterations;
+    run_jobs(threads, NUM_FILTER_STRATEGIES, filter_trial_job, &trials);
+
+    int best = 0;
+    for (int i = 1; i < NUM_FILTER_STRATEGIES; i++) {
+        if (trials.trials[i].compressed_len < trials.trials[best].compressed_len) best = i;
+    }
+
+    uint8_t ihdr[13];
+    unsigned int width_be = htonl(width);
+    unsigned int height_be = htonl(height);
+    memcpy(ihdr, &width_be, 4);
+    memcpy(ihdr + 4, &height_be, 4);
+    ihdr[8] = bit_depth;
+    ihdr[9] = color_type;
+    ihdr[10] = 0; //compression method
+    ihdr[11] = 0; //filter method
+    ihdr[12] = 0; //interlace method
+
+    int result = -1;
+    FILE* fp = fopen(filepath, "wb");
+    if (fp) {
+        char signature[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+        if (fwrite(signature, 1, 8, fp) == 8
+            && !write_chunk(fp, "IHDR", ihdr, 13)
+            && (!palette || !write_chunk(fp, "PLTE", palette, palette_len))
+            && (!trns || !write_chunk(fp, "tRNS", trns, trns_len))
+            && !write_chunk(fp, "IDAT", trials.trials[best].compressed, trials.trials[best].compressed_len)
+            && !write_chunk(fp, "IEND", NULL, 0)) {
+            result = 0;
+        }
+        fclose(fp);
+    } else {
+        fprintf(stderr, "COULD NOT OPEN %s\n", filepath);
+    }
+
+    for (int i = 0; i < NUM_FILTER_STRATEGIES; i++) {
+        free(trials.trials[i].compressed);
+    }
+    return result;
+}
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define IDAT_BUFFER_SIZE 65536  //IDAT data is read this many bytes at a time no matter how big the chunk is
+#define PIPELINE_BATCHES 8      //row batches in flight between the pipeline threads
+#define PIPELINE_BATCH_ROWS 16  //scanlines per row batch
+
+//Image header
+//As defined here: https://www.w3.org/TR/png/#11IHDR
+struct IHDR {
+    unsigned int width;
+    unsigned int height;
+    uint8_t bit_depth;
+    uint8_t color_type;
+    uint8_t compression;
+    uint8_t filter;
+    uint8_t interlace;
+};
+
+//A PNG read up to its image data, then handing the IDAT data to an InflateStream a piece at a time
+struct PNGStream {
+    FILE* fp;
+    struct IHDR ihdr;
+    uint8_t palette[768];
+    int palette_len;
+    uint8_t trns[256];
+    int trns_len;
+    unsigned int chunk_left;    //bytes of the current IDAT not read yet
+    uint32_t crc;               //running CRC of the current IDAT
+    int idat_done;
+    int error;
+    uint8_t buf[IDAT_BUFFER_SIZE];
+};
+
+int check_signature(FILE* fp);
+
+int read_chunk_header(FILE* fp, unsigned int* len, char chunk_type[4]);
+
+int check_chunk_crc(FILE* fp, uint32_t crc, char* chunk_type);
+
+int parse_IHDR(uint8_t* data, unsigned int len, struct IHDR* ihdr);
+
+int open_png_stream(char* filepath, struct PNGStream* stream);
+
+int refill_IDAT(void* ctx, uint8_t** buf, size_t* len);
+
+void close_png_stream(struct PNGStream* stream);
+
+int read_PNG_rows(char* filepath, struct IHDR* ihdr, int (*row_callback)(void* user, int y, uint8_t* row, size_t row_len), void* user,
+                  struct InflateStats* stats);
+
+int read_PNG_pipelined(char* filepath, struct IHDR* ihdr, int (*pixel_callback)(void* user, int y, uint8_t* rgba, int width), void* user,
+                       struct InflateStats* stats);
+
+int inflate_rows(struct InflateStream* inflate, struct IHDR* ihdr, int (*row_callback)(void* user, int pass, int y, uint8_t* row, int width),
+                 int (*pass_callback)(void* user, int pass), void* user);
+
+uint8_t* inflate_image(struct InflateStream* inflate, struct IHDR* ihdr, int fill_blocks, int (*pass_callback)(void* user, int pass, uint8_t* image, size_t row_len), void* user);
+
+uint8_t* read_PNG_image(char* filepath, struct IHDR* ihdr, int fill_blocks, int (*pass_callback)(void* user, int pass, uint8_t* image, size_t row_len), void* user,
+                        struct InflateStats* stats);
+
+uint8_t* read_PNG_thumbnail(char* filepath, struct IHDR* ihdr, int* thumb_width, int* thumb_height, struct InflateStats* stats);
+
+int write_PNG_max(char* filepath, uint8_t* pixels, int width, int height, uint8_t bit_depth, uint8_t color_type,
+                  uint8_t* palette, int palette_len, uint8_t* trns, int trns_len, int iterations, int threads);
@@ -0,0 +1,68 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+//Shared state for the workers of one run_jobs call
+struct JobQueue {
+    void (*job)(void* ctx, int index);
+    void* ctx;
+    int next;   //next job index to hand out
+    int count;
+    pthread_mutex_t lock;
+};
+
+/**
+ * Takes job indices off the queue until there are none left
+ * @param void* arg is the struct JobQueue*
+ * @return NULL
+*/
+void* job_worker(void* arg) {
+    struct JobQueue* queue = arg;
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        int index = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (index >= queue->count) break;
+        queue->job(queue->ctx, index);
+    }
+    return NULL;
+}
+
+/**
+ * Runs job(ctx, i) for every i in [0, num_jobs) across num_threads threads and waits for all of them.
+ * The calling thread works too so num_threads of 1 runs everything in order on the caller
+ * @param int num_threads is the most threads to use
+ * @param int num_jobs is the number of jobs
+ * @param void (*job)(void* ctx, int index) is the job to run.  Must be safe to run at the same time as itself
+ * @param void* ctx is passed to every job
+*/
+void run_jobs(int num_threads, int num_jobs, void (*job)(void* ctx, int index), void* ctx) {
+    if (num_threads > num_jobs) num_threads = num_jobs;
+    if (num_threads <= 1) {
+        for (int i = 0; i < num_jobs; i++) job(ctx, i);
+        return;
+    }
+
+    struct JobQueue queue;
+    queue.job = job;
+    queue.ctx = ctx;
+    queue.next = 0;
+    queue.count = num_jobs;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    pthread_t* threads = malloc((num_threads - 1) * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; i < num_threads - 1; i++) {
+        if (pthread_create(&threads[i], NULL, job_worker, &queue) != 0) break; //the rest of the threads pick up the slack
+        started++;
+    }
+    job_worker(&queue);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&queue.lock);
+}
@@ -0,0 +1 @@
+void run_jobs(int num_threads, int num_jobs, void (*job)(void* ctx, int index), void* ctx);
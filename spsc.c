@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <sched.h>
+
+#include "spsc.h"
+
+/**
+ * Sets up an empty queue
+ * @param struct SPSCQueue* q is the queue
+ * @param size_t capacity is the most items the queue holds.  Rounded up to a power of 2
+*/
+void spsc_init(struct SPSCQueue* q, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    q->slots = calloc(size, sizeof(void*));
+    q->mask = size - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->sleeping, 0);
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->wake, NULL);
+}
+
+/**
+ * Frees the queue's slots.  Does not free the items
+ * @param struct SPSCQueue* q is the queue
+*/
+void spsc_free(struct SPSCQueue* q) {
+    free(q->slots);
+    q->slots = NULL;
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->wake);
+}
+
+/**
+ * Adds an item to the back of the queue.  Only call from the producer thread
+ * @param struct SPSCQueue* q is the queue
+ * @param void* item is the item to add
+ * @return 0 if the queue is full 1 otherwise
+*/
+int spsc_push(struct SPSCQueue* q, void* item) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - head > q->mask) return 0;
+
+    q->slots[tail & q->mask] = item;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release); //publishes the item
+
+    //pairs with the fence in spsc_pop_wait so either the consumer sees the item or this sees it sleeping
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->sleeping, memory_order_relaxed)) spsc_wake(q);
+    return 1;
+}
+
+/**
+ * Takes the item at the front of the queue.  Only call from the consumer thread
+ * @param struct SPSCQueue* q is the queue
+ * @return the item or NULL if the queue is empty
+*/
+void* spsc_pop(struct SPSCQueue* q) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head == tail) return NULL;
+
+    void* item = q->slots[head & q->mask];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release); //hands the slot back to the producer
+    return item;
+}
+
+/**
+ * Takes the item at the front of the queue, waiting until one arrives.  Yields the thread SPSC_SPIN_LIMIT times in
+ * case the producer is about to push, then sleeps so a slow producer does not keep the core busy
+ * @param struct SPSCQueue* q is the queue
+ * @param atomic_int* stop gives up waiting when it becomes nonzero.  Whoever sets it calls spsc_wake
+ * @return the item or NULL if stop was set
+*/
+void* spsc_pop_wait(struct SPSCQueue* q, atomic_int* stop) {
+    void* item;
+    for (int spins = 0; spins < SPSC_SPIN_LIMIT; spins++) {
+        if ((item = spsc_pop(q)) != NULL) return item;
+        if (atomic_load_explicit(stop, memory_order_acquire)) return NULL;
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&q->lock);
+    atomic_store_explicit(&q->sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    while ((item = spsc_pop(q)) == NULL && !atomic_load_explicit(stop, memory_order_acquire)) {
+        pthread_cond_wait(&q->wake, &q->lock);
+    }
+    atomic_store_explicit(&q->sleeping, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+/**
+ * Wakes the consumer if it is sleeping in spsc_pop_wait so it looks at the queue and its stop flag again
+ * @param struct SPSCQueue* q is the queue
+*/
+void spsc_wake(struct SPSCQueue* q) {
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_broadcast(&q->wake);
+    pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,32 @@
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define CACHE_LINE 64
+#define SPSC_SPIN_LIMIT 64  //times spsc_pop_wait yields before it sleeps until woken
+
+//Lock-free queue for exactly one producer thread and one consumer thread
+struct SPSCQueue {
+    void** slots;
+    size_t mask;    //capacity - 1, capacity is a power of 2
+    char pad0[CACHE_LINE];
+    atomic_size_t head;     //next slot to pop, only written by the consumer
+    char pad1[CACHE_LINE];
+    atomic_size_t tail;     //next slot to push, only written by the producer
+    char pad2[CACHE_LINE];
+    atomic_int sleeping;    //true while the consumer waits on wake
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+void spsc_init(struct SPSCQueue* q, size_t capacity);
+
+void spsc_free(struct SPSCQueue* q);
+
+int spsc_push(struct SPSCQueue* q, void* item);
+
+void* spsc_pop(struct SPSCQueue* q);
+
+void* spsc_pop_wait(struct SPSCQueue* q, atomic_int* stop);
+
+void spsc_wake(struct SPSCQueue* q);
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "huffman.h"
+#include "deflate.h"
+#include "inflate.h"
+#include "filter.h"
+#include "png.h"
+#include "convert.h"
+#include "cpu.h"
+
+#define BENCH_WIDTH 2048        //pixels in each benchmark scanline
+#define BENCH_SECONDS 0.02      //how long each kernel is timed for in one run
+#define BENCH_RUNS 5            //runs of each kernel, the fastest being kept so other load on the machine matters less
+
+/**
+ * Returns the time in seconds on the monotonic clock
+ * @return the time in seconds
+*/
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * Returns random bytes so the branches in the kernels are not predictable
+ * @param size_t len is the number of bytes
+ * @param uint32_t seed picks the bytes
+ * @return the MALLOCED bytes
+*/
+uint8_t* random_bytes(size_t len, uint32_t seed) {
+    uint8_t* data = malloc(len);
+    uint32_t state = seed * 2654435761u + 1;
+    for (size_t i = 0; i < len; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        data[i] = state >> 8;
+    }
+    return data;
+}
+
+/**
+ * Times an unfilter kernel on one filter type, unfiltering the same scanline in place over and over.  Keeps the
+ * fastest of BENCH_RUNS runs
+ * @param int (*unfilter)(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp) is the kernel
+ * @param uint8_t filter_type is the filter type to reverse
+ * @param uint8_t* row is the scanline
+ * @param uint8_t* prev is the scanline above
+ * @param int row_len is the number of bytes in the scanline
+ * @param int bpp is the bytes per complete pixel rounded up to 1
+ * @return nanoseconds per byte
+*/
+double time_unfilter(int (*unfilter)(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp),
+                     uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp) {
+    double best = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        long calls = 0;
+        double start = now();
+        double elapsed;
+        do {
+            for (int i = 0; i < 16; i++) unfilter(filter_type, row, prev, row_len, bpp);
+            calls += 16;
+            elapsed = now() - start;
+        } while (elapsed < BENCH_SECONDS);
+        double ns = elapsed * 1e9 / ((double) calls * row_len);
+        if (run == 0 || ns < best) best = ns;
+    }
+    return best;
+}
+
+/**
+ * Times a conversion kernel, converting the same scanline over and over.  Keeps the fastest of BENCH_RUNS runs
+ * @param void (*convert)(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out) is the kernel
+ * @param struct ColorInfo* info is the image's color info
+ * @param uint8_t* row is the scanline
+ * @param uint8_t* out is where the RGBA pixels are written
+ * @return nanoseconds per pixel
+*/
+double time_convert(void (*convert)(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out), struct ColorInfo* info,
+                    uint8_t* row, uint8_t* out) {
+    double best = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        long calls = 0;
+        double start = now();
+        double elapsed;
+        do {
+            for (int i = 0; i < 16; i++) convert(info, row, BENCH_WIDTH, out);
+            calls += 16;
+            elapsed = now() - start;
+        } while (elapsed < BENCH_SECONDS);
+        double ns = elapsed * 1e9 / ((double) calls * BENCH_WIDTH);
+        if (run == 0 || ns < best) best = ns;
+    }
+    return best;
+}
+
+/**
+ * Prints one benchmark line comparing a specialized kernel with the generic one it replaces
+ * @param char* name is what was timed
+ * @param double generic is the generic kernel's time
+ * @param double specialized is the specialized kernel's time
+ * @param char* unit is what the times are per
+ * @return 1 if the specialized kernel is slower 0 otherwise
+*/
+int report(char* name, double generic, double specialized, char* unit) {
+    int slower = specialized >= generic;
+    printf("%-32s generic %7.3f  specialized %7.3f ns/%s  %5.2fx%s\n", name, generic, specialized, unit, generic / specialized,
+           slower ? "  SLOWER" : "");
+    return slower;
+}
+
+/**
+ * Times every unfilter kernel row_unfilterer can pick against the generic unfilter_row_scalar, and the SSE2 ones
+ * against unfilter_row_sse2 too.  unfilter_row_sse2 already runs the same kernel for Up and for 3 and 4 byte pixels
+ * so those are left out, apart from Sub on 3 byte pixels which uses the scalar kernel instead
+ * @return the number of specialized kernels that were slower
+*/
+int bench_unfilter() {
+    char* type_names[] = {"None", "Sub", "Up", "Average", "Paeth"};
+    int pixel_bytes[] = {1, 2, 3, 4, 6, 8};
+    int (*scalar[])(uint8_t, uint8_t*, uint8_t*, int, int) = {unfilter_row_bpp1, unfilter_row_bpp2, unfilter_row_bpp3,
+                                                               unfilter_row_bpp4, unfilter_row_bpp6, unfilter_row_bpp8};
+#if defined(__x86_64__) || defined(__i386__)
+    int (*sse2[])(uint8_t, uint8_t*, uint8_t*, int, int) = {unfilter_row_bpp1_sse2, unfilter_row_bpp2_sse2, unfilter_row_bpp3_sse2,
+                                                             unfilter_row_bpp4_sse2, unfilter_row_bpp6_sse2, unfilter_row_bpp8_sse2};
+#endif
+    int slower = 0;
+    for (int k = 0; k < 6; k++) {
+        int bpp = pixel_bytes[k];
+        int row_len = BENCH_WIDTH * bpp;
+        uint8_t* row = random_bytes(row_len, bpp);
+        uint8_t* prev = random_bytes(row_len, bpp + 100);
+        for (uint8_t type = FILTER_SUB; type <= FILTER_PAETH; type++) {
+            char name[64];
+            snprintf(name, sizeof(name), "unfilter bpp %d %s", bpp, type_names[type]);
+            double generic = time_unfilter(unfilter_row_scalar, type, row, prev, row_len, bpp);
+            slower += report(name, generic, time_unfilter(scalar[k], type, row, prev, row_len, bpp), "byte");
+#if defined(__x86_64__) || defined(__i386__)
+            int same_kernel = type == FILTER_UP || bpp == 4 || (bpp == 3 && type != FILTER_SUB);
+            if (cpu_features.sse2 && !same_kernel) {
+                snprintf(name, sizeof(name), "unfilter bpp %d %s sse2", bpp, type_names[type]);
+                generic = time_unfilter(unfilter_row_sse2, type, row, prev, row_len, bpp);
+                slower += report(name, generic, time_unfilter(sse2[k], type, row, prev, row_len, bpp), "byte");
+            }
+#endif
+        }
+        free(row);
+        free(prev);
+    }
+    return slower;
+}
+
+/**
+ * Times the conversion kernel row_converter picks for every color type and bit depth against convert_row_RGBA8
+ * @return the number of specialized kernels that were slower
+*/
+int bench_convert() {
+    uint8_t formats[15][2] = {{0, 1}, {0, 2}, {0, 4}, {0, 8}, {0, 16}, {2, 8}, {2, 16}, {3, 1}, {3, 2}, {3, 4}, {3, 8},
+                              {4, 8}, {4, 16}, {6, 8}, {6, 16}};
+    uint8_t palette[768];
+    for (int i = 0; i < 768; i++) palette[i] = i * 7;
+    uint8_t* out = malloc((size_t) BENCH_WIDTH * 4);
+
+    int slower = 0;
+    for (int k = 0; k < 15; k++) {
+        uint8_t color_type = formats[k][0];
+        uint8_t bit_depth = formats[k][1];
+        size_t row_len = scanline_bytes(BENCH_WIDTH, bits_per_pixel(color_type, bit_depth));
+        uint8_t* row = random_bytes(row_len, k);
+        struct ColorInfo* info = malloc(sizeof(struct ColorInfo));
+        init_color_info(info, color_type, bit_depth, palette, 256, NULL, 0);
+
+        char name[64];
+        snprintf(name, sizeof(name), "convert color type %d depth %d", color_type, bit_depth);
+        double generic = time_convert(convert_row_RGBA8, info, row, out);
+        slower += report(name, generic, time_convert(info->convert, info, row, out), "pixel");
+        free(info);
+        free(row);
+    }
+    free(out);
+    return slower;
+}
+
+/**
+ * Benchmarks the specialized unfilter and conversion kernels against the generic loops they replace
+ * @return 1 if any specialized kernel was slower 0 otherwise
+*/
+int main() {
+    report_cpu_dispatch(stdout);
+    int slower = bench_unfilter() + bench_convert();
+    if (slower) printf("%d SPECIALIZED KERNELS SLOWER\n", slower);
+    return slower != 0;
+}
@@ -0,0 +1,218 @@
+# Writes the PNG fixtures the tests decode, next to this script.  Each .png has a .raw
+# holding the unfiltered scanlines a decoder should produce.  Only needs the Python
+# standard library; the output is the same every run.
+import os, random, struct, zlib
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SIGNATURE = b'\x89PNG\r\n\x1a\n'
+
+def chunk(kind, data):
+    return struct.pack('>I', len(data)) + kind + data + struct.pack('>I', zlib.crc32(kind + data))
+
+def paeth(a, b, c):
+    p = a + b - c
+    pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+    return a if pa <= pb and pa <= pc else b if pb <= pc else c
+
+def filter_rows(rows, bpp, only=None):
+    """Filters each scanline with filter type y % 5 so every type is used, or with only."""
+    out, prev = [], bytes(len(rows[0]))
+    for y, row in enumerate(rows):
+        kind = y % 5 if only is None else only
+        filtered = bytearray()
+        for i in range(len(row)):
+            a = row[i - bpp] if i >= bpp else 0
+            b = prev[i]
+            c = prev[i - bpp] if i >= bpp else 0
+            predict = [0, a, b, (a + b) >> 1, paeth(a, b, c)][kind]
+            filtered.append((row[i] - predict) & 255)
+        out.append(bytes([kind]) + bytes(filtered))
+        prev = row
+    return b''.join(out)
+
+def bits_per_pixel(color_type, bit_depth):
+    return {0: 1, 2: 3, 3: 1, 4: 2, 6: 4}[color_type] * bit_depth
+
+def random_rows(rng, width, height, bits):
+    """Scanlines of smooth gradients with noise, padding bits left as zero."""
+    row_len = (width * bits + 7) // 8
+    rows = []
+    for y in range(height):
+        row = bytearray((x * 7 + y * 3 + rng.randrange(4)) & 255 for x in range(row_len))
+        if (width * bits) % 8:
+            row[-1] &= (0xff << (8 - (width * bits) % 8)) & 0xff
+        rows.append(bytes(row))
+    return rows
+
+def write_png(name, width, height, bit_depth, color_type, rows, idat_size, extra=b''):
+    bpp = max(1, bits_per_pixel(color_type, bit_depth) // 8)
+    z = zlib.compress(filter_rows(rows, bpp), 9)
+    png = SIGNATURE + chunk(b'IHDR', struct.pack('>IIBBBBB', width, height, bit_depth, color_type, 0, 0, 0)) + extra
+    for i in range(0, len(z), idat_size):
+        png += chunk(b'IDAT', z[i:i + idat_size])
+    png += chunk(b'IEND', b'')
+    open(os.path.join(HERE, name + '.png'), 'wb').write(png)
+    open(os.path.join(HERE, name + '.raw'), 'wb').write(b''.join(rows))
+
+rng = random.Random(27)
+
+# scanline streaming: small IDAT chunks so scanlines straddle chunk boundaries
+write_png('rows_rgb8', 61, 40, 8, 2, random_rows(rng, 61, 40, 24), 97, chunk(b'tEXt', b'Comment\x00rows'))
+
+# tree cache: the same 8 scanlines 20 times, each group its own full flush block.  The
+# blocks are byte for byte the same so all but the first reuse the cached trees
+group = random_rows(rng, 50, 8, 24)
+filtered = filter_rows(group, 3, only=1)
+compressor = zlib.compressobj(9)
+z = b''.join(compressor.compress(filtered) + compressor.flush(zlib.Z_FULL_FLUSH) for _ in range(20)) + compressor.flush()
+png = SIGNATURE + chunk(b'IHDR', struct.pack('>IIBBBBB', 50, 160, 8, 2, 0, 0, 0)) + chunk(b'IDAT', z) + chunk(b'IEND', b'')
+open(os.path.join(HERE, 'flush_blocks.png'), 'wb').write(png)
+open(os.path.join(HERE, 'flush_blocks.raw'), 'wb').write(b''.join(group) * 20)
+
+# pipeline errors: a scanline past the batches first in flight has filter type 7
+rows = random_rows(rng, 50, 160, 24)
+filtered = bytearray(filter_rows(rows, 3))
+filtered[150 * (50 * 3 + 1)] = 7
+png = SIGNATURE + chunk(b'IHDR', struct.pack('>IIBBBBB', 50, 160, 8, 2, 0, 0, 0))
+png += chunk(b'IDAT', zlib.compress(bytes(filtered), 9)) + chunk(b'IEND', b'')
+open(os.path.join(HERE, 'bad_filter.png'), 'wb').write(png)
+
+# Adam7: odd sizes so passes are ragged, and a 3x2 image where most passes are empty.
+# The .raw is the whole image as a non interlaced decoder would give it
+ADAM7 = [(0, 0, 8, 8), (4, 0, 8, 8), (0, 4, 4, 8), (2, 0, 4, 4), (0, 2, 2, 4), (1, 0, 2, 2), (0, 1, 1, 2)]
+
+def get_pixel(row, x, bits):
+    if bits >= 8:
+        return row[x * bits // 8:(x + 1) * bits // 8]
+    return (row[x * bits // 8] >> (8 - bits - x * bits % 8)) & ((1 << bits) - 1)
+
+def pack_pixels(pixels, bits):
+    if bits >= 8:
+        return b''.join(pixels)
+    out = bytearray((len(pixels) * bits + 7) // 8)
+    for i, sample in enumerate(pixels):
+        out[i * bits // 8] |= sample << (8 - bits - i * bits % 8)
+    return bytes(out)
+
+def write_adam7_png(name, width, height, bit_depth, color_type):
+    bits = bits_per_pixel(color_type, bit_depth)
+    rows = random_rows(rng, width, height, bits)
+    data = b''
+    for x_start, y_start, x_step, y_step in ADAM7:
+        xs = range(x_start, width, x_step)
+        if len(xs) == 0:
+            continue
+        sub = [pack_pixels([get_pixel(rows[y], x, bits) for x in xs], bits) for y in range(y_start, height, y_step)]
+        if sub:
+            data += filter_rows(sub, max(1, bits // 8))
+    png = SIGNATURE + chunk(b'IHDR', struct.pack('>IIBBBBB', width, height, bit_depth, color_type, 0, 0, 1))
+    png += chunk(b'IDAT', zlib.compress(data, 9)) + chunk(b'IEND', b'')
+    open(os.path.join(HERE, name + '.png'), 'wb').write(png)
+    open(os.path.join(HERE, name + '.raw'), 'wb').write(b''.join(rows))
+
+write_adam7_png('adam7_rgb8', 33, 27, 8, 2)
+write_adam7_png('adam7_rgba16', 19, 13, 16, 6)
+write_adam7_png('adam7_grey2', 13, 11, 2, 0)
+write_adam7_png('adam7_grey1_3x2', 3, 2, 1, 0)
+
+# APNG: each file has a .frames holding the RGBA canvas after every frame, drawn here
+# the way the APNG spec says so the decoder is checked against an independent compositor
+def pixel_bytes(px, bit_depth):
+    return b''.join(struct.pack('>H', v) if bit_depth == 16 else bytes([v]) for v in px)
+
+def to_rgba(px, color_type, bit_depth, palette, trns):
+    if color_type == 3:
+        return palette[px[0]] + (trns[px[0]] if px[0] < len(trns) else 255,)
+    samples = tuple(v >> 8 if bit_depth == 16 else v for v in px)
+    return samples if color_type == 6 else samples + (255,)
+
+def blend_over(dest, src):
+    if src[3] == 255 or dest[3] == 0:
+        return src
+    if src[3] == 0:
+        return dest
+    src_weight = src[3] * 255
+    dest_weight = (255 - src[3]) * dest[3]
+    total = src_weight + dest_weight
+    return tuple((src[c] * src_weight + dest[c] * dest_weight) // total for c in range(3)) + (total // 255,)
+
+def random_pixels(width, height, color_type, bit_depth, palette_len):
+    top = (1 << bit_depth) - 1
+    def pixel():
+        if color_type == 3:
+            return (rng.randrange(palette_len),)
+        rgb = tuple(rng.randrange(top + 1) for _ in range(3))
+        return rgb if color_type == 2 else rgb + (rng.choice([0, top, rng.randrange(top + 1)]),)
+    return [[pixel() for x in range(width)] for y in range(height)]
+
+def compress_pixels(pixels, color_type, bit_depth):
+    rows = [b''.join(pixel_bytes(px, bit_depth) for px in row) for row in pixels]
+    return zlib.compress(filter_rows(rows, bits_per_pixel(color_type, bit_depth) // 8), 9)
+
+def write_apng(name, width, height, bit_depth, color_type, frame_count, hidden_default=False, break_sequence=None,
+               claimed_frames=None):
+    """Frames after the first get random regions, and between them use every dispose and blend op.
+    hidden_default puts an IDAT outside the animation first, written to .default as RGBA.
+    break_sequence is 'fdAT' to skip a sequence number in the last frame or 'fcTL' to repeat one.
+    claimed_frames is a frame count for acTL other than the frames written."""
+    palette = [tuple(rng.randrange(256) for _ in range(3)) for _ in range(64)]
+    trns = [rng.choice([0, 255, rng.randrange(256)]) for _ in range(40)]
+    png = SIGNATURE + chunk(b'IHDR', struct.pack('>IIBBBBB', width, height, bit_depth, color_type, 0, 0, 0))
+    if color_type == 3:
+        png += chunk(b'PLTE', b''.join(bytes(c) for c in palette)) + chunk(b'tRNS', bytes(trns))
+    png += chunk(b'acTL', struct.pack('>II', frame_count if claimed_frames is None else claimed_frames, 0))
+    if hidden_default:
+        default = random_pixels(width, height, color_type, bit_depth, len(palette))
+        png += chunk(b'IDAT', compress_pixels(default, color_type, bit_depth))
+        open(os.path.join(HERE, name + '.default'), 'wb').write(
+            b''.join(bytes(to_rgba(px, color_type, bit_depth, palette, trns)) for row in default for px in row))
+
+    canvas = [[(0, 0, 0, 0)] * width for _ in range(height)]
+    expected = b''
+    sequence = 0
+    for f in range(frame_count):
+        if f == 0:
+            w, h, x0, y0 = width, height, 0, 0
+        else:
+            w, h = rng.randint(1, width), rng.randint(1, height)
+            x0, y0 = rng.randint(0, width - w), rng.randint(0, height - h)
+        dispose, blend = f % 3, f // 3 % 2
+        if break_sequence == 'fcTL' and f == frame_count - 1:
+            sequence -= 1
+        png += chunk(b'fcTL', struct.pack('>IIIIIHHBB', sequence, w, h, x0, y0, 1, 10, dispose, blend))
+        sequence += 1
+        pixels = random_pixels(w, h, color_type, bit_depth, len(palette))
+        z = compress_pixels(pixels, color_type, bit_depth)
+        for i in range(0, len(z), 60):
+            if f == 0 and not hidden_default:
+                png += chunk(b'IDAT', z[i:i + 60])
+            else:
+                if break_sequence == 'fdAT' and f == frame_count - 1 and i == 0:
+                    sequence += 1
+                png += chunk(b'fdAT', struct.pack('>I', sequence) + z[i:i + 60])
+                sequence += 1
+
+        # the first frame has nothing before it to go back to
+        if f == 0 and dispose == 2:
+            dispose = 1
+        saved = [row[:] for row in canvas]
+        for y in range(h):
+            for x in range(w):
+                src = to_rgba(pixels[y][x], color_type, bit_depth, palette, trns)
+                canvas[y0 + y][x0 + x] = src if blend == 0 else blend_over(canvas[y0 + y][x0 + x], src)
+        expected += b''.join(bytes(px) for row in canvas for px in row)
+        if dispose == 1:
+            for y in range(h):
+                canvas[y0 + y][x0:x0 + w] = [(0, 0, 0, 0)] * w
+        elif dispose == 2:
+            canvas = saved
+    png += chunk(b'IEND', b'')
+    open(os.path.join(HERE, name + '.png'), 'wb').write(png)
+    open(os.path.join(HERE, name + '.frames'), 'wb').write(expected)
+
+write_apng('apng_rgba8', 24, 18, 8, 6, 9)
+write_apng('apng_rgba16', 13, 11, 16, 6, 6)
+write_apng('apng_hidden', 20, 16, 8, 3, 7, hidden_default=True)
+write_apng('apng_bad_fdAT', 16, 12, 8, 2, 4, break_sequence='fdAT')
+write_apng('apng_bad_fcTL', 16, 12, 8, 2, 4, break_sequence='fcTL')
+write_apng('apng_bad_acTL', 4, 4, 8, 6, 1, claimed_frames=0x7fffffff)
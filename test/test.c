@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "test/test.h"
+
+int test_failures = 0;
+
+/**
+ * Makes bytes that look like image data: smooth runs with some random noise mixed in
+ * @param size_t len is the number of bytes
+ * @param uint32_t seed picks the pattern
+ * @param int noise is how many bytes in 16 are random, 16 for all random bytes
+ * @return the MALLOCED bytes
+*/
+uint8_t* test_pattern(size_t len, uint32_t seed, int noise) {
+    uint8_t* data = malloc(len ? len : 1);
+    uint32_t state = seed * 2654435761u + 1;
+    for (size_t i = 0; i < len; i++) {
+        //xorshift keeps the patterns the same on every platform
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        data[i] = (int) (state & 15) < noise ? state >> 8 : (uint8_t) (i / 7 + seed + (i % 61 == 0) * 31);
+    }
+    return data;
+}
+
+/**
+ * Reads a whole file
+ * @param char* path is the file's path
+ * @param size_t* len is set to the file's length
+ * @return the MALLOCED bytes, NULL if the file cannot be read
+*/
+uint8_t* read_file(char* path, size_t* len) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) return NULL;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    uint8_t* data = malloc(size ? size : 1);
+    if (size < 0 || fread(data, 1, size, fp) != (size_t) size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    *len = size;
+    return data;
+}
+
+/**
+ * Copies a file with some of its bytes changed, for testing damaged files
+ * @param char* src is the file to copy
+ * @param char* dest is where the copy is written
+ * @param size_t keep is how many bytes to keep, the rest are dropped
+ * @param long flip is the offset of a byte to invert, -1 for none
+ * @return -1 if error occurs 0 otherwise
+*/
+int write_damaged_copy(char* src, char* dest, size_t keep, long flip) {
+    size_t len;
+    uint8_t* data = read_file(src, &len);
+    if (data == NULL) return -1;
+    if (keep > len) keep = len;
+    if (flip >= 0 && (size_t) flip < keep) data[flip] ^= 0xff;
+
+    FILE* fp = fopen(dest, "wb");
+    int result = fp && fwrite(data, 1, keep, fp) == keep ? 0 : -1;
+    if (fp) fclose(fp);
+    free(data);
+    return result;
+}
+
+/**
+ * Runs every test and prints how many checks failed
+ * @return 1 if any check failed 0 otherwise
+*/
+int main() {
+    test_deflate();
+    test_filter();
+    test_simd();
+    test_png();
+    test_apng();
+
+    if (test_failures) {
+        printf("%d CHECKS FAILED\n", test_failures);
+        return 1;
+    }
+    printf("ALL TESTS PASSED\n");
+    return 0;
+}
@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//Counts a failed check and prints where it is without stopping the test
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while (0)
+
+//Path of a file made by test/fixtures/make_fixtures.py
+#define FIXTURE(name) "test/fixtures/" name
+
+extern int test_failures;
+
+uint8_t* test_pattern(size_t len, uint32_t seed, int noise);
+
+uint8_t* read_file(char* path, size_t* len);
+
+int write_damaged_copy(char* src, char* dest, size_t keep, long flip);
+
+void test_deflate();
+
+void test_filter();
+
+void test_simd();
+
+void test_png();
+
+void test_apng();
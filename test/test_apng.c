@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "huffman.h"
+#include "deflate.h"
+#include "inflate.h"
+#include "filter.h"
+#include "png.h"
+#include "apng.h"
+#include "test/test.h"
+
+//What the read_APNG callback has seen
+struct FrameLog {
+    uint8_t* expected;  //the canvas after each frame one after another
+    size_t canvas_len;
+    int frames;
+    int in_order;
+    int canvases_ok;
+    int stop_after;     //frame to stop decoding at, -1 to decode everything
+};
+
+/**
+ * read_APNG callback that checks each canvas against the next expected one
+ * @param void* user is the struct FrameLog*
+ * @param int index is the frame
+ * @param uint8_t* canvas is the canvas as RGBA
+ * @param struct FrameControl* fc is the frame's fcTL
+ * @return nonzero once stop_after is reached
+*/
+int log_frame(void* user, int index, uint8_t* canvas, struct FrameControl* fc) {
+    struct FrameLog* log = user;
+    if (index != log->frames || fc == NULL) log->in_order = 0;
+    if (memcmp(canvas, log->expected + (size_t) log->frames * log->canvas_len, log->canvas_len)) log->canvases_ok = 0;
+    log->frames++;
+    return index == log->stop_after;
+}
+
+/**
+ * Decodes an APNG fixture on one and several threads, checks every canvas against the fixture's own compositor, and
+ * stops partway
+ * @param char* png_path is the fixture
+ * @param char* frames_path is the canvases it should give
+ * @param int frame_count is the number of frames
+*/
+void check_apng(char* png_path, char* frames_path, int frame_count) {
+    size_t frames_len;
+    uint8_t* expected = read_file(frames_path, &frames_len);
+    CHECK(expected != NULL);
+    if (expected == NULL) return;
+
+    struct FrameLog log = {expected, frames_len / frame_count, 0, 1, 1, -1};
+    struct IHDR ihdr;
+    for (int threads = 1; threads <= 4; threads += 3) {
+        log.frames = 0;
+        log.in_order = log.canvases_ok = 1;
+        CHECK(read_APNG(png_path, &ihdr, 0, threads, log_frame, &log, NULL) == frame_count);
+        CHECK(log.frames == frame_count && log.in_order && log.canvases_ok);
+        CHECK((size_t) ihdr.width * ihdr.height * 4 == log.canvas_len);
+    }
+
+    log.frames = 0;
+    log.stop_after = 2;
+    CHECK(read_APNG(png_path, &ihdr, 0, 2, log_frame, &log, NULL) == 3);
+    CHECK(log.frames == 3 && log.in_order && log.canvases_ok);
+    free(expected);
+}
+
+/**
+ * Tests APNG decoding: blend and dispose ops, a default image outside the animation, sequence number errors, an acTL
+ * frame count the file does not have and decoding only the default image
+*/
+void test_apng() {
+    check_apng(FIXTURE("apng_rgba8.png"), FIXTURE("apng_rgba8.frames"), 9);
+    check_apng(FIXTURE("apng_rgba16.png"), FIXTURE("apng_rgba16.frames"), 6);
+    //the IDAT before the first fcTL is not part of the animation
+    check_apng(FIXTURE("apng_hidden.png"), FIXTURE("apng_hidden.frames"), 7);
+
+    //first_frame_only gives the default image whether it is the first frame or not
+    size_t len;
+    uint8_t* first = read_file(FIXTURE("apng_rgba8.frames"), &len);
+    struct FrameLog log = {first, 24 * 18 * 4, 0, 1, 1, -1};
+    struct IHDR ihdr;
+    CHECK(first != NULL && read_APNG(FIXTURE("apng_rgba8.png"), &ihdr, 1, 1, log_frame, &log, NULL) == 1);
+    CHECK(log.frames == 1 && log.in_order && log.canvases_ok);
+    free(first);
+
+    uint8_t* hidden = read_file(FIXTURE("apng_hidden.default"), &len);
+    log = (struct FrameLog) {hidden, 20 * 16 * 4, 0, 1, 1, -1};
+    CHECK(hidden != NULL && read_APNG(FIXTURE("apng_hidden.png"), &ihdr, 1, 1, log_frame, &log, NULL) == 1);
+    CHECK(log.frames == 1 && log.in_order && log.canvases_ok);
+    free(hidden);
+
+    //a skipped or repeated sequence number fails before any frame is shown
+    uint8_t* bad = read_file(FIXTURE("apng_bad_fdAT.frames"), &len);
+    log = (struct FrameLog) {bad, 16 * 12 * 4, 0, 1, 1, -1};
+    CHECK(bad != NULL && read_APNG(FIXTURE("apng_bad_fdAT.png"), &ihdr, 0, 2, log_frame, &log, NULL) == -1);
+    CHECK(read_APNG(FIXTURE("apng_bad_fcTL.png"), &ihdr, 0, 2, log_frame, &log, NULL) == -1);
+    CHECK(log.frames == 0);
+
+    //first_frame_only never gets as far as the broken chunks
+    CHECK(read_APNG(FIXTURE("apng_bad_fdAT.png"), &ihdr, 1, 1, log_frame, &log, NULL) == 1);
+    CHECK(log.frames == 1 && log.canvases_ok);
+    free(bad);
+
+    //an acTL frame count far past the frames in the file is not allocated up front and fails once IEND is reached
+    uint8_t* claimed = read_file(FIXTURE("apng_bad_acTL.frames"), &len);
+    log = (struct FrameLog) {claimed, 4 * 4 * 4, 0, 1, 1, -1};
+    CHECK(claimed != NULL && read_APNG(FIXTURE("apng_bad_acTL.png"), &ihdr, 0, 2, log_frame, &log, NULL) == -1);
+    CHECK(log.frames == 0);
+    CHECK(read_APNG(FIXTURE("apng_bad_acTL.png"), &ihdr, 1, 1, log_frame, &log, NULL) == 1);
+    CHECK(log.frames == 1 && log.canvases_ok);
+    free(claimed);
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "huffman.h"
+#include "deflate.h"
+#include "inflate.h"
+#include "filter.h"
+#include "png.h"
+#include "apng.h"
+#include "test/test.h"
+
+#define TEST_PNG_PATH "test/tmp_write.png"
+
+/**
+ * Inflates a whole zlib stream held in memory
+ * @param uint8_t* z is the zlib stream
+ * @param size_t z_len is the length of the zlib stream
+ * @param size_t expected_len is the number of bytes the stream should inflate to
+ * @return the MALLOCED bytes, NULL if the stream has an error or is not exactly expected_len bytes long
+*/
+uint8_t* inflate_all(uint8_t* z, size_t z_len, size_t expected_len) {
+    struct MemorySource source = {z, z_len, 0};
+    struct InflateStream* inflate = malloc(sizeof(struct InflateStream));
+    inflate_init(inflate, refill_memory, &source);
+
+    //one byte more than expected so a stream that runs long is caught
+    uint8_t* out = malloc(expected_len + 1);
+    size_t got = inflate_read(inflate, out, expected_len + 1);
+    int ok = got == expected_len && !inflate->error && inflate->state == STREAM_DONE;
+    inflate_end(inflate);
+    free(inflate);
+    if (!ok) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/**
+ * Compresses data with zlib_compress_max and checks inflate_read gives it back
+ * @param size_t len is the number of bytes
+ * @param int noise is how many bytes in 16 are random
+*/
+void check_zlib_round_trip(size_t len, int noise) {
+    uint8_t* data = test_pattern(len, (uint32_t) len, noise);
+    size_t z_len;
+    uint8_t* z = zlib_compress_max(data, len, &z_len, 3, 4);
+    CHECK(z != NULL);
+
+    uint8_t* back = z ? inflate_all(z, z_len, len) : NULL;
+    CHECK(back != NULL);
+    if (back) CHECK(!memcmp(back, data, len));
+    if (noise < 16) CHECK(z_len < len / 2 + 16);
+
+    free(back);
+    free(z);
+    free(data);
+}
+
+/**
+ * Writes an image with write_PNG_max and checks read_PNG_image gives back the same header and scanlines, and the
+ * tRNS chunk comes back too
+ * @param uint8_t bit_depth is the IHDR bit depth
+ * @param uint8_t color_type is the IHDR color type
+ * @param uint8_t* trns is the tRNS chunk data or NULL
+ * @param int trns_len is the length of the tRNS chunk data
+*/
+void check_PNG_round_trip(uint8_t bit_depth, uint8_t color_type, uint8_t* trns, int trns_len) {
+    int width = 37;
+    int height = 23;
+    size_t row_len = scanline_bytes(width, bits_per_pixel(color_type, bit_depth));
+    uint8_t* pixels = test_pattern(row_len * height, color_type * 32 + bit_depth, 2);
+    uint8_t palette[48];
+    for (int i = 0; i < 48; i++) palette[i] = i * 5;
+
+    int written = write_PNG_max(TEST_PNG_PATH, pixels, width, height, bit_depth, color_type,
+                                color_type == 3 ? palette : NULL, sizeof(palette), trns, trns_len, 1, 4);
+    CHECK(written == 0);
+
+    struct IHDR ihdr;
+    uint8_t* image = read_PNG_image(TEST_PNG_PATH, &ihdr, 0, NULL, NULL, NULL);
+    CHECK(image != NULL);
+    if (image) {
+        CHECK(ihdr.width == (unsigned int) width && ihdr.height == (unsigned int) height);
+        CHECK(ihdr.bit_depth == bit_depth && ihdr.color_type == color_type && !ihdr.interlace);
+        CHECK(!memcmp(image, pixels, row_len * height));
+    }
+
+    struct PNGStream* stream = malloc(sizeof(struct PNGStream));
+    CHECK(open_png_stream(TEST_PNG_PATH, stream) == 0);
+    CHECK(stream->trns_len == (trns ? trns_len : 0));
+    if (trns && stream->trns_len == trns_len) CHECK(!memcmp(stream->trns, trns, trns_len));
+    close_png_stream(stream);
+    free(stream);
+
+    free(image);
+    free(pixels);
+    remove(TEST_PNG_PATH);
+}
+
+/**
+ * Tests the maximum compression encoder and PNG writer by reading back what they write
+*/
+void test_deflate() {
+    check_zlib_round_trip(0, 0);
+    check_zlib_round_trip(1, 0);
+    check_zlib_round_trip(1000, 0);
+    check_zlib_round_trip(100000, 16);
+    //more than one master block
+    check_zlib_round_trip(MASTER_BLOCK_SIZE + 300000, 1);
+
+    uint8_t grey_key[2] = {0, 9};
+    uint8_t rgb_key[6] = {0, 1, 0, 2, 0, 3};
+    uint8_t alphas[5] = {0, 64, 128, 192, 255};
+    check_PNG_round_trip(8, 2, NULL, 0);
+    check_PNG_round_trip(8, 2, rgb_key, sizeof(rgb_key));
+    check_PNG_round_trip(16, 6, NULL, 0);
+    check_PNG_round_trip(8, 4, NULL, 0);
+    check_PNG_round_trip(1, 0, NULL, 0);
+    check_PNG_round_trip(2, 0, NULL, 0);
+    check_PNG_round_trip(16, 0, grey_key, sizeof(grey_key));
+    check_PNG_round_trip(4, 3, alphas, sizeof(alphas));
+
+    //tRNS that does not fit the color type is refused
+    uint8_t pixels[8] = {0};
+    CHECK(write_PNG_max(TEST_PNG_PATH, pixels, 2, 1, 8, 6, NULL, 0, alphas, 1, 1, 1) == -1);
+    CHECK(write_PNG_max(TEST_PNG_PATH, pixels, 2, 1, 8, 2, NULL, 0, grey_key, sizeof(grey_key), 1, 1) == -1);
+
+    //so is a PLTE for greyscale, and one that is not whole RGB entries
+    uint8_t palette[6] = {0, 0, 0, 255, 255, 255};
+    CHECK(write_PNG_max(TEST_PNG_PATH, pixels, 2, 1, 8, 0, palette, sizeof(palette), NULL, 0, 1, 1) == -1);
+    CHECK(write_PNG_max(TEST_PNG_PATH, pixels, 2, 1, 8, 4, palette, sizeof(palette), NULL, 0, 1, 1) == -1);
+    CHECK(write_PNG_max(TEST_PNG_PATH, pixels, 2, 1, 8, 3, palette, 5, NULL, 0, 1, 1) == -1);
+    //but a suggested palette for truecolor is allowed
+    CHECK(write_PNG_max(TEST_PNG_PATH, pixels, 2, 1, 8, 2, palette, sizeof(palette), NULL, 0, 1, 1) == 0);
+    remove(TEST_PNG_PATH);
+}
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+#include "cpu.h"
+#include "test/test.h"
+
+/**
+ * Checks an unfilter kernel gives the same scanline as unfilter_row_scalar for every filter type, and refuses an
+ * invalid filter type the same way
+ * @param int (*unfilter)(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp) is the kernel
+ * @param int bpp is the bytes per complete pixel the kernel is for
+ * @return 1 if every scanline matched 0 otherwise
+*/
+int matches_scalar(int (*unfilter)(uint8_t filter_type, uint8_t* row, uint8_t* prev, int row_len, int bpp), int bpp) {
+    //lengths shorter than a pixel happen for narrow Adam7 passes of sub byte pixels
+    int lengths[] = {1, 2, 3, bpp, bpp * 2, bpp * 5, bpp * 17, bpp * 100 + (bpp == 1 ? 3 : 0)};
+    int ok = 1;
+    for (int k = 0; k < 8; k++) {
+        int row_len = lengths[k];
+        if (bpp > 1 && row_len % bpp) continue;
+        for (uint8_t type = FILTER_NONE; type <= FILTER_PAETH + 1; type++) {
+            uint8_t* row = test_pattern(row_len, row_len * 8 + type, 16);
+            uint8_t* prev = test_pattern(row_len, row_len * 8 + type + 100, 16);
+            uint8_t* expected = malloc(row_len);
+            memcpy(expected, row, row_len);
+            int expected_result = unfilter_row_scalar(type, expected, prev, row_len, bpp);
+            if (unfilter(type, row, prev, row_len, bpp) != expected_result) ok = 0;
+            if (expected_result == 0 && memcmp(row, expected, row_len)) ok = 0;
+            free(row);
+            free(prev);
+            free(expected);
+        }
+    }
+    return ok;
+}
+
+/**
+ * Tests the unfilter kernels for each pixel size against unfilter_row_scalar
+*/
+void test_filter() {
+    CHECK(matches_scalar(unfilter_row_bpp1, 1));
+    CHECK(matches_scalar(unfilter_row_bpp2, 2));
+    CHECK(matches_scalar(unfilter_row_bpp3, 3));
+    CHECK(matches_scalar(unfilter_row_bpp4, 4));
+    CHECK(matches_scalar(unfilter_row_bpp6, 6));
+    CHECK(matches_scalar(unfilter_row_bpp8, 8));
+#if defined(__x86_64__) || defined(__i386__)
+    init_cpu_dispatch();
+    if (cpu_features.sse2) {
+        CHECK(matches_scalar(unfilter_row_bpp1_sse2, 1));
+        CHECK(matches_scalar(unfilter_row_bpp2_sse2, 2));
+        CHECK(matches_scalar(unfilter_row_bpp3_sse2, 3));
+        CHECK(matches_scalar(unfilter_row_bpp4_sse2, 4));
+        CHECK(matches_scalar(unfilter_row_bpp6_sse2, 6));
+        CHECK(matches_scalar(unfilter_row_bpp8_sse2, 8));
+    }
+#endif
+
+    //row_unfilterer picks by the pixel size IHDR gives
+    CHECK(matches_scalar(row_unfilterer(0, 1), 1));
+    CHECK(matches_scalar(row_unfilterer(4, 8), 2));
+    CHECK(matches_scalar(row_unfilterer(2, 8), 3));
+    CHECK(matches_scalar(row_unfilterer(6, 8), 4));
+    CHECK(matches_scalar(row_unfilterer(2, 16), 6));
+    CHECK(matches_scalar(row_unfilterer(6, 16), 8));
+}
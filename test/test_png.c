@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "huffman.h"
+#include "deflate.h"
+#include "inflate.h"
+#include "filter.h"
+#include "png.h"
+#include "interlace.h"
+#include "convert.h"
+#include "test/test.h"
+
+#define DAMAGED_PNG_PATH "test/tmp_damaged.png"
+
+//What the read_PNG_rows callback has seen
+struct RowLog {
+    uint8_t* image;     //scanlines copied in the order they came
+    size_t row_len;
+    int rows;
+    int in_order;
+    int stop_after;     //row to stop decoding at, -1 to decode everything
+};
+
+/**
+ * read_PNG_rows callback that copies each scanline into the log
+ * @param void* user is the struct RowLog*
+ * @param int y is the row
+ * @param uint8_t* row is the unfiltered scanline
+ * @param size_t row_len is the length of the scanline
+ * @return nonzero once stop_after is reached
+*/
+int log_row(void* user, int y, uint8_t* row, size_t row_len) {
+    struct RowLog* log = user;
+    if (y != log->rows || row_len != log->row_len) log->in_order = 0;
+    memcpy(log->image + (size_t) log->rows * log->row_len, row, log->row_len);
+    log->rows++;
+    return y == log->stop_after;
+}
+
+/**
+ * Tests read_PNG_rows against the scanlines the fixture was made from, stopping early and with damaged files
+*/
+void test_read_PNG_rows() {
+    size_t raw_len;
+    uint8_t* raw = read_file(FIXTURE("rows_rgb8.raw"), &raw_len);
+    CHECK(raw != NULL);
+    if (raw == NULL) return;
+
+    struct RowLog log = {malloc(raw_len), 61 * 3, 0, 1, -1};
+    struct IHDR ihdr;
+    CHECK(read_PNG_rows(FIXTURE("rows_rgb8.png"), &ihdr, log_row, &log, NULL) == 0);
+    CHECK(ihdr.width == 61 && ihdr.height == 40 && ihdr.bit_depth == 8 && ihdr.color_type == 2);
+    CHECK(log.rows == 40 && log.in_order);
+    CHECK(!memcmp(log.image, raw, raw_len));
+
+    //stopping is not an error and no scanline comes after the stop
+    log.rows = 0;
+    log.stop_after = 9;
+    CHECK(read_PNG_rows(FIXTURE("rows_rgb8.png"), &ihdr, log_row, &log, NULL) == 0);
+    CHECK(log.rows == 10 && log.in_order);
+
+    //cut off inside the image data, and a flipped byte in the image data that fails the IDAT CRC
+    log.stop_after = -1;
+    log.rows = 0;
+    CHECK(!write_damaged_copy(FIXTURE("rows_rgb8.png"), DAMAGED_PNG_PATH, 3000, -1));
+    CHECK(read_PNG_rows(DAMAGED_PNG_PATH, &ihdr, log_row, &log, NULL) == -1);
+    log.rows = 0;
+    CHECK(!write_damaged_copy(FIXTURE("rows_rgb8.png"), DAMAGED_PNG_PATH, 1 << 20, 2000));
+    CHECK(read_PNG_rows(DAMAGED_PNG_PATH, &ihdr, log_row, &log, NULL) == -1);
+    remove(DAMAGED_PNG_PATH);
+
+    log.rows = 0;
+    CHECK(read_PNG_rows(FIXTURE("missing.png"), &ihdr, log_row, &log, NULL) == -1);
+
+    uint8_t* image = read_PNG_image(FIXTURE("rows_rgb8.png"), &ihdr, 0, NULL, NULL, NULL);
+    CHECK(image && !memcmp(image, raw, raw_len));
+    free(image);
+    free(log.image);
+    free(raw);
+}
+
+/**
+ * read_PNG_rows callback that does nothing with the scanlines
+ * @return 0 to keep decoding
+*/
+int skip_row(void* user, int y, uint8_t* row, size_t row_len) {
+    (void) user;
+    (void) y;
+    (void) row;
+    (void) row_len;
+    return 0;
+}
+
+/**
+ * Tests the tree cache counters come back from the read APIs on a stream of repeated full flush blocks
+*/
+void test_tree_cache_stats() {
+    size_t raw_len;
+    uint8_t* raw = read_file(FIXTURE("flush_blocks.raw"), &raw_len);
+    CHECK(raw != NULL);
+
+    struct IHDR ihdr;
+    struct InflateStats stats;
+    uint8_t* image = read_PNG_image(FIXTURE("flush_blocks.png"), &ihdr, 0, NULL, NULL, &stats);
+    CHECK(image && raw && !memcmp(image, raw, raw_len));
+    //every block after the first has the same code lengths
+    CHECK(stats.tree_cache_misses >= 1 && stats.tree_cache_hits >= 19);
+    free(image);
+
+    struct InflateStats row_stats;
+    CHECK(read_PNG_rows(FIXTURE("flush_blocks.png"), &ihdr, skip_row, NULL, &row_stats) == 0);
+    CHECK(row_stats.tree_cache_hits == stats.tree_cache_hits && row_stats.tree_cache_misses == stats.tree_cache_misses);
+    free(raw);
+}
+
+//What the read_PNG_pipelined callback has seen
+struct PixelLog {
+    uint8_t* rgba;      //scanlines copied in the order they came
+    int width;
+    int rows;
+    int in_order;
+    int stop_after;     //row to stop decoding at, -1 to decode everything
+    int delay_us;       //sleep for each scanline so the callback is the slowest stage
+};
+
+/**
+ * read_PNG_pipelined callback that copies each scanline into the log
+ * @param void* user is the struct PixelLog*
+ * @param int y is the row
+ * @param uint8_t* rgba is the scanline as RGBA
+ * @param int width is the number of pixels
+ * @return nonzero once stop_after is reached
+*/
+int log_pixels(void* user, int y, uint8_t* rgba, int width) {
+    struct PixelLog* log = user;
+    if (y != log->rows || width != log->width) log->in_order = 0;
+    memcpy(log->rgba + (size_t) log->rows * width * 4, rgba, (size_t) width * 4);
+    log->rows++;
+    if (log->delay_us) usleep(log->delay_us);
+    return y == log->stop_after;
+}
+
+/**
+ * Returns the time in seconds on a clock
+ * @param clockid_t clock is CLOCK_MONOTONIC for wall time or CLOCK_PROCESS_CPUTIME_ID for CPU time
+ * @return the time in seconds
+*/
+double seconds(clockid_t clock) {
+    struct timespec t;
+    clock_gettime(clock, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * Tests read_PNG_pipelined gives the fixture's pixels in order, stops when the callback asks, passes errors from
+ * every stage back through the joins, and does not keep cores busy while the callback is slow
+*/
+void test_read_PNG_pipelined() {
+    size_t raw_len;
+    uint8_t* raw = read_file(FIXTURE("flush_blocks.raw"), &raw_len);
+    CHECK(raw != NULL);
+    if (raw == NULL) return;
+    int width = 50;
+    int height = 160;
+    uint8_t* expected = malloc((size_t) width * height * 4);
+    for (int i = 0; i < width * height; i++) {
+        memcpy(expected + i * 4, raw + i * 3, 3);
+        expected[i * 4 + 3] = 255;
+    }
+
+    struct PixelLog log = {malloc((size_t) width * height * 4), width, 0, 1, -1, 0};
+    struct IHDR ihdr;
+    struct InflateStats stats;
+    CHECK(read_PNG_pipelined(FIXTURE("flush_blocks.png"), &ihdr, log_pixels, &log, &stats) == 0);
+    CHECK(log.rows == height && log.in_order);
+    CHECK(!memcmp(log.rgba, expected, (size_t) width * height * 4));
+    CHECK(stats.tree_cache_hits >= 19);
+
+    //stopping is not an error and no scanline comes after the stop
+    log.rows = 0;
+    log.stop_after = 20;
+    CHECK(read_PNG_pipelined(FIXTURE("flush_blocks.png"), &ihdr, log_pixels, &log, NULL) == 0);
+    CHECK(log.rows == 21 && log.in_order);
+
+    //while the callback is the bottleneck the waiting threads sleep instead of spinning
+    log.rows = 0;
+    log.stop_after = -1;
+    log.delay_us = 1000;
+    double wall = seconds(CLOCK_MONOTONIC);
+    double cpu = seconds(CLOCK_PROCESS_CPUTIME_ID);
+    CHECK(read_PNG_pipelined(FIXTURE("flush_blocks.png"), &ihdr, log_pixels, &log, NULL) == 0);
+    wall = seconds(CLOCK_MONOTONIC) - wall;
+    cpu = seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    CHECK(log.rows == height);
+    CHECK(cpu < wall / 10);
+    log.delay_us = 0;
+
+    //an inflate error on the calling thread: IDAT cut off partway
+    log.rows = 0;
+    CHECK(!write_damaged_copy(FIXTURE("flush_blocks.png"), DAMAGED_PNG_PATH, 6000, -1));
+    CHECK(read_PNG_pipelined(DAMAGED_PNG_PATH, &ihdr, log_pixels, &log, NULL) == -1);
+    CHECK(log.rows < height && log.in_order);
+
+    //a CRC error partway through the IDAT
+    log.rows = 0;
+    CHECK(!write_damaged_copy(FIXTURE("flush_blocks.png"), DAMAGED_PNG_PATH, 1 << 20, 7000));
+    CHECK(read_PNG_pipelined(DAMAGED_PNG_PATH, &ihdr, log_pixels, &log, NULL) == -1);
+    CHECK(log.rows < height);
+    remove(DAMAGED_PNG_PATH);
+
+    //an unfilter error on the second thread, after the first batches have gone through
+    log.rows = 0;
+    CHECK(read_PNG_pipelined(FIXTURE("bad_filter.png"), &ihdr, log_pixels, &log, NULL) == -1);
+    CHECK(log.rows <= 150 && log.in_order);
+
+    free(log.rgba);
+    free(expected);
+    free(raw);
+}
+
+//What the read_PNG_image pass callback has seen of an Adam7 image
+struct PassLog {
+    uint8_t* raw;       //the whole image the fixture should decode to
+    int width;
+    int height;
+    int bytes;          //bytes per pixel, 0 below 8 bits where the pass images are not checked
+    size_t row_len;
+    int passes;
+    int in_order;
+    int images_ok;      //every pass image matched check_pass_image
+    int fill_blocks;
+    int stop_after;     //pass to stop decoding after, -1 to decode everything
+};
+
+/**
+ * Checks the image after some Adam7 passes.  After pass N each pixel stands in for the block of
+ * adam7_block_width[N-1] by adam7_block_height[N-1] pixels starting at it, so every pixel should hold the pixel at the
+ * corner of its block with fill_blocks, or zeros if it is not a corner without
+ * @param struct PassLog* log has the fixture
+ * @param uint8_t* image is the image so far
+ * @param int pass is the last pass decoded from 1 to 7
+ * @return 1 if the image is right 0 otherwise
+*/
+int check_pass_image(struct PassLog* log, uint8_t* image, int pass) {
+    uint8_t zeros[8] = {0};
+    int block_width = adam7_block_width[pass - 1];
+    int block_height = adam7_block_height[pass - 1];
+    for (int y = 0; y < log->height; y++) {
+        for (int x = 0; x < log->width; x++) {
+            int corner_x = x - x % block_width;
+            int corner_y = y - y % block_height;
+            uint8_t* expected = log->raw + (size_t) corner_y * log->row_len + (size_t) corner_x * log->bytes;
+            if (!log->fill_blocks && (corner_x != x || corner_y != y)) expected = zeros;
+            if (memcmp(image + (size_t) y * log->row_len + (size_t) x * log->bytes, expected, log->bytes)) return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * read_PNG_image pass callback that checks the passes come 1 to 7 and each leaves the right image
+ * @param void* user is the struct PassLog*
+ * @param int pass is the pass from 1 to 7
+ * @param uint8_t* image is the image so far
+ * @param size_t row_len is the length of a scanline
+ * @return nonzero once stop_after is reached
+*/
+int log_pass(void* user, int pass, uint8_t* image, size_t row_len) {
+    struct PassLog* log = user;
+    log->passes++;
+    if (pass != log->passes || row_len != log->row_len) log->in_order = 0;
+    if (log->bytes && !check_pass_image(log, image, pass)) log->images_ok = 0;
+    return pass == log->stop_after;
+}
+
+/**
+ * Decodes an Adam7 fixture whole, pass by pass, and stopped after each pass with and without fill_blocks
+ * @param char* png_path is the interlaced fixture
+ * @param char* raw_path is the image it should decode to
+*/
+void check_adam7(char* png_path, char* raw_path) {
+    size_t raw_len;
+    uint8_t* raw = read_file(raw_path, &raw_len);
+    CHECK(raw != NULL);
+    if (raw == NULL) return;
+
+    struct IHDR ihdr;
+    uint8_t* image = read_PNG_image(png_path, &ihdr, 0, NULL, NULL, NULL);
+    CHECK(image != NULL && ihdr.interlace == 1);
+    if (image == NULL) {
+        free(raw);
+        return;
+    }
+    int bits = bits_per_pixel(ihdr.color_type, ihdr.bit_depth);
+    struct PassLog log = {raw, ihdr.width, ihdr.height, bits >= 8 ? bits / 8 : 0, scanline_bytes(ihdr.width, bits),
+                          0, 1, 1, 0, -1};
+    CHECK(raw_len == log.row_len * ihdr.height && !memcmp(image, raw, raw_len));
+    free(image);
+
+    for (int fill_blocks = 0; fill_blocks <= 1; fill_blocks++) {
+        for (int stop_after = 1; stop_after <= ADAM7_PASSES; stop_after++) {
+            log.passes = 0;
+            log.in_order = 1;
+            log.images_ok = 1;
+            log.fill_blocks = fill_blocks;
+            log.stop_after = stop_after;
+            image = read_PNG_image(png_path, &ihdr, fill_blocks, log_pass, &log, NULL);
+            CHECK(image != NULL);
+            CHECK(log.passes == stop_after && log.in_order && log.images_ok);
+            //the image handed back is the one the last pass callback saw
+            if (image && log.bytes) CHECK(check_pass_image(&log, image, stop_after));
+            free(image);
+        }
+    }
+
+    //the scanline and pipelined readers only take non interlaced images
+    struct RowLog row_log = {NULL, 0, 0, 1, -1};
+    CHECK(read_PNG_rows(png_path, &ihdr, log_row, &row_log, NULL) == -1 && row_log.rows == 0);
+    struct PixelLog pixel_log = {NULL, 0, 0, 1, -1, 0};
+    CHECK(read_PNG_pipelined(png_path, &ihdr, log_pixels, &pixel_log, NULL) == -1 && pixel_log.rows == 0);
+    free(raw);
+}
+
+/**
+ * Tests Adam7 decoding, including images too small for some passes
+*/
+void test_adam7() {
+    check_adam7(FIXTURE("adam7_rgb8.png"), FIXTURE("adam7_rgb8.raw"));
+    check_adam7(FIXTURE("adam7_rgba16.png"), FIXTURE("adam7_rgba16.raw"));
+    check_adam7(FIXTURE("adam7_grey2.png"), FIXTURE("adam7_grey2.raw"));
+    check_adam7(FIXTURE("adam7_grey1_3x2.png"), FIXTURE("adam7_grey1_3x2.raw"));
+}
+
+/**
+ * Shrinks an RGBA image with a plain box filter: each image pixel goes to thumbnail pixel (x * thumb width / width,
+ * y * thumb height / height) and each thumbnail pixel is the alpha weighted average of the pixels it gets
+ * @param uint8_t* rgba is the image
+ * @param int width is the image width
+ * @param int height is the image height
+ * @param int thumb_width is the thumbnail width
+ * @param int thumb_height is the thumbnail height
+ * @return the MALLOCED thumbnail
+*/
+uint8_t* box_filter(uint8_t* rgba, int width, int height, int thumb_width, int thumb_height) {
+    uint64_t* sums = calloc((size_t) thumb_width * thumb_height * 5, sizeof(uint64_t));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint8_t* px = rgba + ((size_t) y * width + x) * 4;
+            uint64_t* sum = sums + ((size_t) (y * thumb_height / height) * thumb_width + x * thumb_width / width) * 5;
+            for (int c = 0; c < 3; c++) sum[c] += px[c] * px[3];
+            sum[3] += px[3];
+            sum[4]++;
+        }
+    }
+    uint8_t* thumb = malloc((size_t) thumb_width * thumb_height * 4);
+    for (size_t i = 0; i < (size_t) thumb_width * thumb_height; i++) {
+        uint64_t* sum = sums + i * 5;
+        for (int c = 0; c < 3; c++) thumb[i * 4 + c] = sum[3] ? (sum[c] + sum[3] / 2) / sum[3] : 0;
+        thumb[i * 4 + 3] = (sum[3] + sum[4] / 2) / sum[4];
+    }
+    free(sums);
+    return thumb;
+}
+
+/**
+ * Checks read_PNG_thumbnail against box_filter on the fixture's pixels for several sizes, including ones larger than
+ * the image which are clamped to it
+ * @param char* png_path is the fixture, not paletted so its pixels convert without the PLTE
+*/
+void check_thumbnail(char* png_path) {
+    struct IHDR ihdr;
+    uint8_t* image = read_PNG_image(png_path, &ihdr, 0, NULL, NULL, NULL);
+    CHECK(image != NULL);
+    if (image == NULL) return;
+    int width = ihdr.width;
+    int height = ihdr.height;
+    size_t row_len = scanline_bytes(width, bits_per_pixel(ihdr.color_type, ihdr.bit_depth));
+    struct ColorInfo info;
+    init_color_info(&info, ihdr.color_type, ihdr.bit_depth, NULL, 0, NULL, 0);
+    uint8_t* rgba = malloc((size_t) width * height * 4);
+    for (int y = 0; y < height; y++) convert_row_RGBA8(&info, image + y * row_len, width, rgba + (size_t) y * width * 4);
+
+    int sizes[][2] = {{1, 1}, {7, 5}, {width / 2, height / 3 + 1}, {width - 1, height}, {width, height},
+                      {width + 9, height * 3}, {0x7fffffff, 0x7fffffff}};
+    for (int i = 0; i < 7; i++) {
+        int thumb_width = sizes[i][0];
+        int thumb_height = sizes[i][1];
+        uint8_t* thumb = read_PNG_thumbnail(png_path, &ihdr, &thumb_width, &thumb_height, NULL);
+        CHECK(thumb != NULL);
+        CHECK(thumb_width == (sizes[i][0] < width ? sizes[i][0] : width));
+        CHECK(thumb_height == (sizes[i][1] < height ? sizes[i][1] : height));
+        if (thumb == NULL) continue;
+        uint8_t* expected = box_filter(rgba, width, height, thumb_width, thumb_height);
+        CHECK(!memcmp(thumb, expected, (size_t) thumb_width * thumb_height * 4));
+        //the full size thumbnail is the image itself apart from the colors of transparent pixels
+        if (thumb_width == width && thumb_height == height && ihdr.color_type != 4 && ihdr.color_type != 6) {
+            CHECK(!memcmp(thumb, rgba, (size_t) width * height * 4));
+        }
+        free(expected);
+        free(thumb);
+    }
+
+    int zero = 0;
+    int one = 1;
+    CHECK(read_PNG_thumbnail(png_path, &ihdr, &zero, &one, NULL) == NULL);
+    free(rgba);
+    free(image);
+}
+
+/**
+ * Tests read_PNG_thumbnail on interlaced and non interlaced images, with and without alpha
+*/
+void test_thumbnail() {
+    check_thumbnail(FIXTURE("rows_rgb8.png"));
+    check_thumbnail(FIXTURE("flush_blocks.png"));
+    check_thumbnail(FIXTURE("apng_rgba8.png"));
+    check_thumbnail(FIXTURE("adam7_rgb8.png"));
+    check_thumbnail(FIXTURE("adam7_rgba16.png"));
+}
+
+/**
+ * Tests decoding the PNG fixtures
+*/
+void test_png() {
+    test_read_PNG_rows();
+    test_tree_cache_stats();
+    test_read_PNG_pipelined();
+    test_adam7();
+    test_thumbnail();
+}
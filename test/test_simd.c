@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "huffman.h"
+#include "deflate.h"
+#include "inflate.h"
+#include "filter.h"
+#include "png.h"
+#include "apng.h"
+#include "checksum.h"
+#include "convert.h"
+#include "cpu.h"
+#include "test/test.h"
+
+#define SIMD_TRIALS 200     //random inputs given to each kernel
+
+/**
+ * Returns the next number of an xorshift sequence
+ * @param uint32_t* state is the sequence, never 0
+ * @return the next number
+*/
+uint32_t simd_random(uint32_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/**
+ * Checks a checksum kernel against its scalar twin on random lengths, alignments and starting values
+ * @param uint32_t (*kernel)(uint32_t value, uint8_t* buf, size_t len) is the kernel
+ * @param uint32_t (*scalar)(uint32_t value, uint8_t* buf, size_t len) is the scalar twin
+ * @param int adler is true for Adler-32, whose two halves must each be below ADLER_BASE
+ * @return 1 if every checksum matched 0 otherwise
+*/
+int checksum_matches(uint32_t (*kernel)(uint32_t value, uint8_t* buf, size_t len), uint32_t (*scalar)(uint32_t value, uint8_t* buf, size_t len), int adler) {
+    uint32_t state = 1;
+    uint8_t* data = test_pattern(3 * ADLER_NMAX + 64, 32, 16);
+    int ok = 1;
+    for (int trial = 0; trial < SIMD_TRIALS; trial++) {
+        //mostly short buffers around the vector widths, sometimes past ADLER_NMAX
+        size_t len = trial % 8 ? simd_random(&state) % 300 : simd_random(&state) % (3 * ADLER_NMAX);
+        size_t offset = simd_random(&state) % 64;
+        uint32_t value = simd_random(&state);
+        if (adler) value = (value >> 16) % ADLER_BASE << 16 | (value & 0xffff) % ADLER_BASE;
+        if (kernel(value, data + offset, len) != scalar(value, data + offset, len)) ok = 0;
+    }
+    free(data);
+    return ok;
+}
+
+/**
+ * Checks unfilter_row_sse2 against unfilter_row_scalar on random scanlines of every pixel size and filter type
+ * @return 1 if every scanline matched 0 otherwise
+*/
+int unfilter_matches() {
+    uint32_t state = 2;
+    int pixel_bytes[6] = {1, 2, 3, 4, 6, 8};
+    int ok = 1;
+    for (int trial = 0; trial < SIMD_TRIALS; trial++) {
+        int bpp = pixel_bytes[simd_random(&state) % 6];
+        int row_len = bpp * (simd_random(&state) % 70);
+        uint8_t type = simd_random(&state) % (FILTER_PAETH + 2);
+        uint8_t* row = test_pattern(row_len, trial, 16);
+        uint8_t* prev = test_pattern(row_len, trial + 1000, 16);
+        uint8_t* expected = malloc(row_len + 1);
+        memcpy(expected, row, row_len);
+
+        int expected_result = unfilter_row_scalar(type, expected, prev, row_len, bpp);
+        if (unfilter_row_sse2(type, row, prev, row_len, bpp) != expected_result) ok = 0;
+        if (!expected_result && memcmp(row, expected, row_len)) ok = 0;
+        free(row);
+        free(prev);
+        free(expected);
+    }
+    return ok;
+}
+
+/**
+ * Checks copy_match_sse2 against copy_match_scalar on random distances and lengths, including copies that overlap
+ * themselves and copies that wrap around the end of the window
+ * @return 1 if the windows and the bytes copied out always matched 0 otherwise
+*/
+int copy_match_matches() {
+    uint32_t state = 3;
+    struct InflateStream* a = malloc(sizeof(struct InflateStream));
+    struct InflateStream* b = malloc(sizeof(struct InflateStream));
+    uint8_t* window = test_pattern(WINDOW_SIZE, 33, 16);
+    uint8_t out_a[MAX_MATCH];
+    uint8_t out_b[MAX_MATCH];
+    int ok = 1;
+    for (int trial = 0; trial < SIMD_TRIALS; trial++) {
+        int dist = trial % 2 ? 1 + simd_random(&state) % 40 : 1 + simd_random(&state) % WINDOW_SIZE;
+        int len = MIN_MATCH + simd_random(&state) % (MAX_MATCH - MIN_MATCH + 1);
+        //every few trials the copy runs past the end of the window
+        size_t total_out = WINDOW_SIZE * (1 + trial % 3) + (trial % 4 ? simd_random(&state) % WINDOW_SIZE : (uint32_t) (WINDOW_SIZE - len / 2));
+        memcpy(a->window, window, WINDOW_SIZE);
+        memcpy(b->window, window, WINDOW_SIZE);
+        a->total_out = b->total_out = total_out;
+        a->copy_dist = b->copy_dist = dist;
+        a->copy_len = b->copy_len = len;
+
+        copy_match_scalar(a, out_a, len);
+        copy_match_sse2(b, out_b, len);
+        if (a->total_out != b->total_out || memcmp(out_a, out_b, len) || memcmp(a->window, b->window, WINDOW_SIZE)) ok = 0;
+    }
+    free(window);
+    free(a);
+    free(b);
+    return ok;
+}
+
+/**
+ * Makes random code lengths for a complete prefix code by splitting random leaves until there are enough.  Long codes
+ * past DECODE_TABLE_BITS come up often so the tree walk is checked too
+ * @param int* lengths is set to the code lengths
+ * @param int len is the number of symbols
+ * @param uint32_t* state is the random sequence
+*/
+void random_code_lengths(int* lengths, int len, uint32_t* state) {
+    int depths[288] = {1, 1};
+    int leaves = 2;
+    int target = 2 + simd_random(state) % (len - 1);
+    for (int tries = 0; leaves < target && tries < 10000; tries++) {
+        int i = simd_random(state) % leaves;
+        if (depths[i] == 15) continue;
+        depths[i]++;
+        depths[leaves++] = depths[i];
+    }
+
+    //the leaves go to random symbols, the rest are unused
+    memset(lengths, 0, len * sizeof(int));
+    for (int i = 0; i < leaves; i++) {
+        int sym = simd_random(state) % len;
+        while (lengths[sym]) sym = (sym + 1) % len;
+        lengths[sym] = depths[i];
+    }
+}
+
+/**
+ * Checks stream_decode_sym_bmi2 against stream_decode_sym_table by decoding random bits with random trees, stopping
+ * short of the end of the input
+ * @return 1 if every symbol matched 0 otherwise
+*/
+int decode_sym_matches() {
+    uint32_t state = 4;
+    struct InflateStream* a = malloc(sizeof(struct InflateStream));
+    struct InflateStream* b = malloc(sizeof(struct InflateStream));
+    int ok = 1;
+    for (int trial = 0; trial < SIMD_TRIALS / 10; trial++) {
+        int lengths[288];
+        int len = trial % 2 ? 288 : 19;
+        random_code_lengths(lengths, len, &state);
+        struct DecodeTree* root = decode_tree_from_lengths(lengths, len);
+        if (root == NULL) {
+            ok = 0;
+            continue;
+        }
+
+        //a complete code decodes any bits, so random input is a valid stream of symbols
+        uint8_t* bits = test_pattern(2000, trial, 16);
+        struct MemorySource source_a = {bits, 2000, 0};
+        struct MemorySource source_b = {bits, 2000, 0};
+        inflate_init(a, refill_memory, &source_a);
+        inflate_init(b, refill_memory, &source_b);
+        //codes are at most 15 bits so 1000 symbols never run out of the 2000 bytes
+        for (int i = 0; i < 1000 && !a->error && !b->error; i++) {
+            int sym_a = stream_decode_sym_table(a, root);
+            int sym_b = stream_decode_sym_bmi2(b, root);
+            if (sym_a != sym_b || a->bit_count != b->bit_count) {
+                ok = 0;
+                break;
+            }
+        }
+        if (a->error != b->error) ok = 0;
+        inflate_end(a);
+        inflate_end(b);
+        free_decode_tree(root);
+        free(bits);
+    }
+    free(a);
+    free(b);
+    return ok;
+}
+
+/**
+ * Checks an SSSE3 conversion kernel against convert_row_RGBA8 on random scanlines of random widths, with and without
+ * a tRNS key
+ * @param void (*kernel)(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out) is the kernel
+ * @param uint8_t color_type is the color type the kernel is for
+ * @param uint8_t bit_depth is the bit depth the kernel is for
+ * @return 1 if every pixel matched 0 otherwise
+*/
+int convert_matches(void (*kernel)(struct ColorInfo* info, uint8_t* row, int width, uint8_t* out), uint8_t color_type, uint8_t bit_depth) {
+    uint32_t state = 5 + color_type * 32 + bit_depth;
+    struct ColorInfo* info = malloc(sizeof(struct ColorInfo));
+    int bits = bits_per_pixel(color_type, bit_depth);
+    int ok = 1;
+    for (int trial = 0; trial < SIMD_TRIALS; trial++) {
+        int width = simd_random(&state) % 100;
+        //a pixel longer than the scanline so there is always a first pixel to take the key from
+        uint8_t* row = test_pattern(scanline_bytes(width, bits) + 8, trial, 16);
+        //a key taken from the first pixel so it matches at least once
+        uint8_t key[6] = {0, row[0], 0, row[1], 0, row[2]};
+        int use_key = trial % 2 && color_type == 2 && bit_depth == 8;
+        init_color_info(info, color_type, bit_depth, NULL, 0, use_key ? key : NULL, use_key ? 6 : 0);
+
+        uint8_t* expected = malloc((size_t) width * 4 + 1);
+        uint8_t* out = malloc((size_t) width * 4 + 1);
+        convert_row_RGBA8(info, row, width, expected);
+        kernel(info, row, width, out);
+        if (memcmp(out, expected, (size_t) width * 4)) ok = 0;
+        free(row);
+        free(expected);
+        free(out);
+    }
+    free(info);
+    return ok;
+}
+
+/**
+ * Checks sum_premultiplied_sse2 against sum_premultiplied_scalar on random pixels
+ * @return 1 if every sum matched 0 otherwise
+*/
+int sum_premultiplied_matches() {
+    uint32_t state = 6;
+    int ok = 1;
+    for (int trial = 0; trial < SIMD_TRIALS; trial++) {
+        int count = simd_random(&state) % 50;
+        uint8_t* rgba = test_pattern((size_t) count * 4 + 1, trial, 16);
+        uint64_t expected[4] = {trial, 0, 0, 0};
+        uint64_t sums[4] = {trial, 0, 0, 0};
+        sum_premultiplied_scalar(rgba, count, expected);
+        sum_premultiplied_sse2(rgba, count, sums);
+        if (memcmp(sums, expected, sizeof(sums))) ok = 0;
+        free(rgba);
+    }
+    return ok;
+}
+
+/**
+ * Runs apply_simd_overrides with PNG_DISABLE_SIMD set to a list
+ * @param char* list is the value of PNG_DISABLE_SIMD
+ * @param struct CPUFeatures* features is set to every instruction set on and then the list applied
+*/
+void override_features(char* list, struct CPUFeatures* features) {
+    features->sse2 = features->ssse3 = features->sse41 = features->avx2 = features->pclmul = features->bmi2 = 1;
+    setenv("PNG_DISABLE_SIMD", list, 1);
+    apply_simd_overrides(features);
+}
+
+/**
+ * Tests PNG_DISABLE_SIMD only turns off the instruction sets named exactly
+*/
+void test_simd_overrides() {
+    char* saved = getenv("PNG_DISABLE_SIMD");
+    if (saved) saved = strdup(saved);
+
+    struct CPUFeatures features;
+    override_features("sse2,avx2", &features);
+    CHECK(!features.sse2 && !features.avx2);
+    CHECK(features.ssse3 && features.sse41 && features.pclmul && features.bmi2);
+
+    override_features("all", &features);
+    CHECK(!features.sse2 && !features.ssse3 && !features.sse41 && !features.avx2 && !features.pclmul && !features.bmi2);
+
+    //names that only contain or are contained in a real one are not it
+    override_features("nosse2,sse,avx2x,,ball", &features);
+    CHECK(features.sse2 && features.ssse3 && features.sse41 && features.avx2 && features.pclmul && features.bmi2);
+
+    if (saved) {
+        setenv("PNG_DISABLE_SIMD", saved, 1);
+        free(saved);
+    } else {
+        unsetenv("PNG_DISABLE_SIMD");
+    }
+}
+
+/**
+ * Tests every SIMD kernel init_cpu_dispatch can bind against its scalar twin.  Kernels this CPU cannot run, or that
+ * PNG_DISABLE_SIMD turned off, are skipped
+*/
+void test_simd() {
+    test_simd_overrides();
+#if defined(__x86_64__) || defined(__i386__)
+    init_cpu_dispatch();
+    if (cpu_features.pclmul && cpu_features.sse41) CHECK(checksum_matches(crc32_pclmul, crc32_scalar, 0));
+    if (cpu_features.ssse3) CHECK(checksum_matches(adler32_ssse3, adler32_scalar, 1));
+    if (cpu_features.avx2) CHECK(checksum_matches(adler32_avx2, adler32_scalar, 1));
+    if (cpu_features.sse2) {
+        CHECK(unfilter_matches());
+        CHECK(copy_match_matches());
+        CHECK(sum_premultiplied_matches());
+    }
+    if (cpu_features.bmi2) CHECK(decode_sym_matches());
+    if (cpu_features.ssse3) {
+        CHECK(convert_matches(convert_ct2_bd8_ssse3, 2, 8));
+        CHECK(convert_matches(convert_ct4_bd8_ssse3, 4, 8));
+        CHECK(convert_matches(convert_ct6_bd16_ssse3, 6, 16));
+    }
+#endif
+}